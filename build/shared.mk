@@ -42,6 +42,10 @@ FLAGS += -mssse3
 endif
 endif
 
+ifeq ($(CONFIG_PCM),y)
+FLAGS += -DCONFIG_PCM
+endif
+
 CFLAGS = -std=gnu11 $(FLAGS)
 CXXFLAGS = -std=gnu++20 $(FLAGS)
 
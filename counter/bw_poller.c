@@ -1,7 +1,11 @@
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <base/stddef.h>
+#include <base/cpu.h>
 #include <base/limits.h>
 #include <base/log.h>
 
@@ -9,22 +13,62 @@
 #include "sched.h"
 #include "ksched.h"
 #include "pmc.h"
+#include "sample.h"
+#include "publish.h"
+#include "mem_ctrl.h"
+#include "task.h"
+#include "cgroup.h"
+#include "policy.h"
+#include "resctrl.h"
+#include "estimate.h"
+#include "subsample.h"
+#include "wait.h"
 
 #define IAS_POLL_INTERVAL_US		100000
+/* the default share of CPU time sampling may take (see ias_adapt_interval) */
+#define IAS_OVERHEAD_BUDGET		0.01
+/* the weight of the newest window in the variability averages */
+#define IAS_ADAPT_ALPHA			0.25
+/* the window halves above this variability (coefficient of variation) */
+#define IAS_ADAPT_CV_HIGH		0.2
+/* and grows by IAS_ADAPT_GROW after a few windows below this one */
+#define IAS_ADAPT_CV_LOW		0.05
+#define IAS_ADAPT_GROW			1.25
+#define IAS_ADAPT_STABLE_WINDOWS	3
+/* the cpu.max period used while throttling */
+#define IAS_BW_PERIOD_US		100000
+/* the smallest quota a cgroup is throttled to (a tenth of a CPU) */
+#define IAS_BW_MIN_QUOTA_US		10000
+/* bandwidth must drop this far below the limit before releasing */
+#define IAS_BW_HYSTERESIS		0.9
+/* the windows below the release threshold between release steps */
+#define IAS_BW_RELEASE_WINDOWS		5
 
 /* the current time in microseconds */
 uint64_t now_us;
+/* the current length of a sampling window in microseconds */
+uint64_t ias_interval_us = IAS_POLL_INTERVAL_US;
 uint64_t ias_bw_sample_failures;
+/* false if the CPU lacks the counters, so nothing is sampled */
+static bool ias_bw_enabled;
 float	 ias_bw_estimate;
 float	 ias_bw_estimate_multiplier;
 
-/* bandwidth threshold in cache lines per cycle for a single channel */
-// static float ias_bw_thresh;
+/* bandwidth threshold in cache lines per cycle for all channels */
+static float ias_bw_thresh;
 
-struct pmc_sample {
-	uint64_t gen;
-	uint64_t val;
-	uint64_t tsc;
+/* the group of counters sampled together on each core */
+enum {
+	IAS_PMC_LLC_MISSES = 0,
+	IAS_PMC_LLC_REF,
+	IAS_PMC_NR,
+};
+
+BUILD_ASSERT(IAS_PMC_NR <= KSCHED_NR_PMC);
+
+static const uint64_t ias_pmc_sel[IAS_PMC_NR] = {
+	[IAS_PMC_LLC_MISSES]	= PMC_LLC_MISSES,
+	[IAS_PMC_LLC_REF]	= PMC_LLC_REF,
 };
 
 enum {
@@ -34,68 +78,154 @@ enum {
 };
 
 static struct pmc_sample arr_1[NCPU], arr_2[NCPU];
+/* the samples in arr_1 and arr_2, packed by sampled core for estimate.c */
+static struct est_snapshot snap_1, snap_2;
 
-static void ias_bw_request_pmc(uint64_t sel, struct pmc_sample *samples)
+/* the backend used to sample the counters (selected at startup) */
+const struct sample_ops *sample_ops = &ksched_sample_ops;
+
+static void ias_bw_request_pmc(struct pmc_sample *samples)
 {
-	struct ias_data *sd;
-	int core, tmp;
+	sample_ops->request(samples);
+}
 
-	sched_for_each_allowed_core(core, tmp) {
-		// sd = cores[core];
-		// if (!sd) continue;
-		// if (!sd || sd->is_lc ||
-		//     bitmap_test(ias_ht_punished_cores, core)) {
-		// 	samples[core].gen = ias_gen[core] - 1;
-		// 	continue;
-		// }
+static struct est_snapshot *ias_snapshot(struct pmc_sample *samples)
+{
+	return samples == arr_1 ? &snap_1 : &snap_2;
+}
 
-		// samples[core].gen = ias_gen[core];
-		ksched_enqueue_pmc(core, sel);
+/* packs the samples of the sampled cores, in sched_cores_tbl order */
+static void ias_bw_pack_pmc(struct pmc_sample *samples,
+			    struct est_snapshot *snap)
+{
+	struct ksched_pmc_sample *s;
+	int i;
+
+	for (i = 0; i < sched_cores_nr; i++) {
+		s = &samples[sched_cores_tbl[i]].pmc;
+		snap->tsc[i] = s->tsc;
+		snap->misses[i] = s->val[IAS_PMC_LLC_MISSES];
+		snap->refs[i] = s->val[IAS_PMC_LLC_REF];
+		snap->instrs[i] = s->fixed[KSCHED_FIXED_INSTR_RETIRED];
+		snap->cycles[i] = s->fixed[KSCHED_FIXED_CORE_CYCLES];
+		/* unhalted cycles at the TSC rate, comparable with the TSC */
+		snap->busy[i] = cfg.ias_norm == IAS_NORM_MPERF ? s->mperf :
+				s->fixed[KSCHED_FIXED_REF_CYCLES];
 	}
 }
 
 static void ias_bw_gather_pmc(struct pmc_sample *samples)
 {
+	struct pmc_sample *last = samples == arr_1 ? arr_2 : arr_1;
 	int core, tmp;
-	struct pmc_sample *s;
 
-	sched_for_each_allowed_core(core, tmp) {
-		s = &samples[core];
-		// if (s->gen != ias_gen[core])
-		// 	continue;
-		if (!ksched_poll_pmc(core, &s->val, &s->tsc)) {
-			// s->gen = ias_gen[core] - 1;
-			ias_bw_sample_failures++;
-			continue;
+	ias_bw_sample_failures += sample_ops->gather(samples);
+
+	/* the cores that sat the window out keep their last sample */
+	if (cfg.ias_subsample) {
+		sched_for_each_allowed_core(core, tmp) {
+			if (!bitmap_test(sample_cores, core))
+				samples[core] = last[core];
 		}
 	}
+
+	record_window(samples);
+	ias_bw_pack_pmc(samples, ias_snapshot(samples));
 }
 
 static float ias_measure_bw_mem_ctrl(void)
 {
-	static uint64_t last_tsc = 0;
-	static uint32_t last_cas = 0;
-	uint64_t tsc;
-	uint32_t cur_cas;
-	float bw_estimate;
+	float bw_estimate = 0.0;
+	unsigned int i;
 
 	/* update the bandwidth estimate */
-	barrier();
-	tsc = rdtsc();
-	barrier();
-	cur_cas = pcm_caladan_get_cas_count(0);
-	bw_estimate = (float)(cur_cas - last_cas) / (float)(tsc - last_tsc);
-	last_cas = cur_cas;
-	last_tsc = tsc;
+	mc_poll();
+	for (i = 0; i < mc_nr_sockets; i++)
+		bw_estimate += mc_sockets[i].rd_rate + mc_sockets[i].wr_rate;
+
 	ias_bw_estimate = bw_estimate;
 	return bw_estimate;
 }
 
-static float cores[NCPU];
+/* each sampled core's index in sched_cores_tbl, or -1 */
+static int ias_core_idx[NCPU];
+
+/* the sibling of a sampled core if it was sampled too, or NCPU */
+static unsigned int ias_ht_sibling(unsigned int core)
+{
+	unsigned int sib = sched_siblings[core];
+
+	if (sib >= NCPU || ias_core_idx[sib] < 0)
+		return NCPU;
+	return sib;
+}
+
+/*
+ * Sums the misses of both hyperthreads of each physical core. Each thread's
+ * counter only sees its own misses, so the sum counts every miss once (which
+ * AnyThread counters on both siblings would not).
+ */
+static void ias_ht_pairs(struct counter_shm_window *w)
+{
+	struct est_window *c = &est_win;
+	unsigned int sib;
+	uint64_t tsc;
+	int i, j, core;
+
+	for (i = 0; i < sched_cores_nr; i++) {
+		core = sched_cores_tbl[i];
+		sib = ias_ht_sibling(core);
+		if (sib == NCPU) {
+			c->pair_miss_rate[i] = c->miss_rate[i];
+		} else {
+			j = ias_core_idx[sib];
+			tsc = MAX(c->tsc[i], c->tsc[j]);
+			c->pair_miss_rate[i] = tsc ?
+				(float)(c->misses[i] + c->misses[j]) / (float)tsc :
+				0.0;
+			/* their deltas span different windows */
+			if (!c->sampled[i] || !c->sampled[j])
+				c->pair_miss_rate[i] = c->miss_rate[i] +
+						       c->miss_rate[j];
+			if (core < sib)
+				log_info("NOW: %" PRIu64 " | Pair [%d,%u] - "
+					 "miss rate = %.5f (%.5f + %.5f), L2 "
+					 "miss rate = %.5f + %.5f",
+					 now_us, core, sib, c->pair_miss_rate[i],
+					 c->miss_rate[i], c->miss_rate[j],
+					 c->l2_miss_rate[i], c->l2_miss_rate[j]);
+		}
+
+		if (w) {
+			w->cores[i].sibling = sib;
+			w->cores[i].pair_miss_rate = c->pair_miss_rate[i];
+		}
+	}
+}
 
 void ias_estimate_bw(struct pmc_sample *start, struct pmc_sample *end) {
-	float highest_l3miss_rate = 0.0, bw_estimate;
-	int core, tmp;
+	float highest_l3miss_rate = 0.0;
+	struct ksched_pmc_sample *s, *e;
+	struct est_window *c = &est_win;
+	struct counter_shm_window *w;
+	struct wait_stats ws;
+	struct counter_shm_core *p;
+	struct mc_socket *m;
+	struct task_stats *t;
+	struct counter_shm_cgroup *pc;
+	struct cg_stats *cg;
+	float mbps;
+	size_t len;
+	unsigned int sib;
+	int core, tmp, i;
+
+	/* the deltas and rates of every sampled core, at once */
+	est_compute(ias_snapshot(start), ias_snapshot(end), sched_cores_nr);
+	subsample_window(ias_bw_estimate_multiplier);
+
+	w = publish_begin();
+	task_begin_window();
+	cg_begin_window();
 	sched_for_each_allowed_core(core, tmp) {
 		// if (cores[core] == NULL ||
 		//     start[core].gen != end[core].gen ||
@@ -103,23 +233,403 @@ void ias_estimate_bw(struct pmc_sample *start, struct pmc_sample *end) {
 		// 	continue;
 		// }
 
-		float miss_count = (float)(end[core].val - start[core].val);
-		bw_estimate = miss_count / (float)(end[core].tsc - start[core].tsc);
-		cores[core] = bw_estimate;
-		// cores[core]->bw_llc_miss_rate += bw_estimate;
+		s = &start[core].pmc;
+		e = &end[core].pmc;
+		t = NULL;
+		if (c->sampled[tmp])
+			t = task_account(s, e, c->misses[tmp], c->instrs[tmp],
+					 c->miss_rate[tmp]);
+
+		if (sched_policy) {
+			policy_cores.core[tmp] = core;
+			policy_cores.socket[tmp] = cpu_info_tbl[core].package;
+			policy_cores.tgid[tmp] = t ? t->tgid : 0;
+			sib = ias_ht_sibling(core);
+			policy_cores.sibling[tmp] = sib == NCPU ? -1 :
+						    ias_core_idx[sib];
+		}
+
+		if (!w)
+			continue;
+		p = &w->cores[tmp];
+		p->core = core;
+		p->tgid = t ? t->tgid : 0;
+		p->tsc_start = s->tsc;
+		p->tsc_end = e->tsc;
+		p->llc_misses = c->misses[tmp];
+		p->llc_refs = c->refs[tmp];
+		p->instrs = c->instrs[tmp];
+		p->cycles = c->cycles[tmp];
+		p->busy_cycles = c->busy_cycles[tmp];
+		p->miss_rate = c->miss_rate[tmp];
+		p->busy_miss_rate = c->busy_miss_rate[tmp];
+		p->busy = c->busy[tmp];
+		p->miss_ratio = c->miss_ratio[tmp];
+		p->mpki = c->mpki[tmp];
+		p->ipc = c->ipc[tmp];
+		p->sibling = NCPU;
+		p->pair_miss_rate = 0.0;
+		p->sampled = c->sampled[tmp];
+	}
+
+	if (cfg.ias_ht)
+		ias_ht_pairs(w);
+
+	log_info("NOW: %" PRIu64 " | Memory bandwidth = %.1f MB/s", now_us,
+		 ias_bw_estimate * ias_bw_estimate_multiplier);
+	for (i = 0; i < mc_nr_sockets; i++) {
+		m = &mc_sockets[i];
+		log_info("NOW: %" PRIu64 " | Socket #%d - read %.1f MB/s, "
+			 "write %.1f MB/s",
+			 now_us, i, m->rd_rate * ias_bw_estimate_multiplier,
+			 m->wr_rate * ias_bw_estimate_multiplier);
+	}
+	wait_stats(&ws);
+	log_info("NOW: %" PRIu64 " | Woke %.2f us late on average, %.2f us "
+		 "at most (%s)", now_us, ws.late_us, ws.late_max_us,
+		 wait_mode_name());
+	if (cfg.ias_idle_skip)
+		log_info("NOW: %" PRIu64 " | Skipped %u idle cores", now_us,
+			 sample_idle_skipped);
+	for (i = 0; cfg.ias_subsample && i < sub_nr_sockets; i++) {
+		log_info("NOW: %" PRIu64 " | Socket #%d - LLC misses %.1f MB/s "
+			 "(+/- %.1f, %u of %u cores sampled)", now_us, i,
+			 sub_sockets[i].llc_mbps, sub_sockets[i].llc_mbps_ci,
+			 sub_sockets[i].nr_sampled, sub_sockets[i].nr_cores);
+	}
+	for (i = 0; i < sched_cores_nr; i++) {
+		log_info("NOW: %" PRIu64 " | Core #%d - miss rate = %.5f, busy "
+			 "miss rate = %.5f (busy %.2f), miss ratio = %.4f, "
+			 "mpki = %.3f, ipc = %.3f",
+			 now_us, sched_cores_tbl[i], c->miss_rate[i],
+			 c->busy_miss_rate[i], c->busy[i], c->miss_ratio[i],
+			 c->mpki[i], c->ipc[i]);
+	}
+
+	/* prefer exact per-process totals when ksched keeps them */
+	if (!task_exact_poll(IAS_PMC_LLC_MISSES)) {
+		for (i = 0; i < task_nr; i++) {
+			t = task_list[i];
+			/* skip the idle tasks */
+			if (t->tgid == 0)
+				continue;
+			mbps = t->miss_rate * ias_bw_estimate_multiplier;
+			cg_account(t->tgid, t->misses, t->instrs, mbps);
+			log_info("NOW: %" PRIu64 " | Process %u - %.1f MB/s "
+				 "on %u cores",
+				 now_us, t->tgid, mbps, t->nr_cores);
+		}
+	}
+	rdt_poll();
+	for (i = 0; i < cg_nr; i++) {
+		cg = cg_list[i];
+		log_info("NOW: %" PRIu64 " | Cgroup %s - %.1f MB/s, %" PRIu64
+			 " misses, %" PRIu64 " instrs (%u procs)", now_us,
+			 cg->path, cg->mbps, cg->misses, cg->instrs,
+			 cg->nr_procs);
+		if (cg->rdt_mon)
+			log_info("NOW: %" PRIu64 " | Cgroup %s - LLC "
+				 "occupancy %" PRIu64 " KB, MBM %.1f MB/s "
+				 "(%.1f MB/s local)", now_us,
+				 cg->path, cg->llc_occupancy / 1024,
+				 cg->mbm_total_mbps, cg->mbm_local_mbps);
 	}
 
+	if (sched_policy) {
+		for (i = 0; i < mc_nr_sockets; i++) {
+			m = &mc_sockets[i];
+			policy_sockets.bw_rd_mbps[i] =
+				m->rd_rate * ias_bw_estimate_multiplier;
+			policy_sockets.bw_wr_mbps[i] =
+				m->wr_rate * ias_bw_estimate_multiplier;
+			policy_sockets.bw_mbps[i] = policy_sockets.bw_rd_mbps[i] +
+						    policy_sockets.bw_wr_mbps[i];
+			policy_sockets.llc_mbps[i] = sub_sockets[i].llc_mbps;
+			policy_sockets.llc_mbps_ci[i] = sub_sockets[i].llc_mbps_ci;
+		}
+		policy_window(sched_cores_nr, mc_nr_sockets);
+	}
 
-	for (int i = 0; i < sched_cores_nr; i++) {
-		core = sched_cores_tbl[i];
-		log_info("NOW: %llu | Core #%d - miss rate = %.5f", now_us, core, cores[core]);
+	if (!w)
+		return;
+	w->now_us = now_us;
+	w->nr_cores = sched_cores_nr;
+	w->nr_sockets = mc_nr_sockets;
+	for (i = 0; i < mc_nr_sockets; i++) {
+		m = &mc_sockets[i];
+		w->bw_rd_mbps[i] = m->rd_rate * ias_bw_estimate_multiplier;
+		w->bw_wr_mbps[i] = m->wr_rate * ias_bw_estimate_multiplier;
+		w->bw_mbps[i] = w->bw_rd_mbps[i] + w->bw_wr_mbps[i];
+		w->llc_mbps[i] = sub_sockets[i].llc_mbps;
+		w->llc_mbps_ci[i] = sub_sockets[i].llc_mbps_ci;
+	}
+	w->wait_mode = cfg.wait;
+	w->wake_late_us = ws.late_us;
+	w->wake_late_max_us = ws.late_max_us;
+	w->nr_cgroups = MIN(cg_nr, COUNTER_SHM_MAX_CGROUPS);
+	for (i = 0; i < w->nr_cgroups; i++) {
+		cg = cg_list[i];
+		pc = &w->cgroups[i];
+		pc->id = cg->id;
+		pc->misses = cg->misses;
+		pc->instrs = cg->instrs;
+		pc->bytes = cg->bytes;
+		pc->mbps = cg->mbps;
+		pc->nr_procs = cg->nr_procs;
+		pc->llc_occupancy = cg->llc_occupancy;
+		pc->mbm_total_mbps = cg->mbm_total_mbps;
+		pc->mbm_local_mbps = cg->mbm_local_mbps;
+		/* keep the tail, which names the container */
+		len = strlen(cg->path);
+		strcpy(pc->path, cg->path + len - MIN(len, sizeof(pc->path) - 1));
 	}
+	publish_end(w);
+}
+
+static void ias_bw_write_quota(struct cg_stats *cg)
+{
+	char buf[64];
+	int ret;
+
+	snprintf(buf, sizeof(buf), "%" PRIu64 " %d", cg->quota_us,
+		 IAS_BW_PERIOD_US);
+	ret = cg_write_max(cg->path, buf);
+	if (ret) {
+		log_warn("bw: could not throttle cgroup %s (%s)", cg->path,
+			 strerror(-ret));
+		cg->unthrottleable = true;
+	}
+}
+
+/* tightens a cgroup's CPU quota one step, returns true if it did */
+static bool ias_bw_throttle(struct cg_stats *cg)
+{
+	uint64_t usage, quota;
+
+	if (cg->throttled) {
+		if (cg->quota_us <= IAS_BW_MIN_QUOTA_US)
+			return false;
+		cg->quota_us = MAX(cg->quota_us / 2, IAS_BW_MIN_QUOTA_US);
+		goto out;
+	}
+
+	if (cg_read_usage(cg->path, &usage)) {
+		cg->unthrottleable = true;
+		return false;
+	}
+
+	/* a cgroup needs two usage readings to know how many CPUs it uses */
+	if (!cg->usage_at_us || now_us <= cg->usage_at_us) {
+		cg->usage_us = usage;
+		cg->usage_at_us = now_us;
+		return false;
+	}
+	quota = (usage - cg->usage_us) * IAS_BW_PERIOD_US /
+		(now_us - cg->usage_at_us);
+	cg->usage_us = usage;
+	cg->usage_at_us = now_us;
+
+	if (cg_read_max(cg->path, cg->orig_max, sizeof(cg->orig_max))) {
+		cg->unthrottleable = true;
+		return false;
+	}
+	cg->full_quota_us = MAX(quota, IAS_BW_MIN_QUOTA_US);
+	cg->quota_us = MAX(quota / 2, IAS_BW_MIN_QUOTA_US);
+	cg->throttled = true;
+	/* so a restart can hand it back if counterd is killed */
+	cg_save_throttled();
+
+out:
+	ias_bw_write_quota(cg);
+	if (cg->unthrottleable)
+		return false;
+	log_info("NOW: %" PRIu64 " | bw: throttling cgroup %s to %.2f CPUs",
+		 now_us, cg->path, (float)cg->quota_us / IAS_BW_PERIOD_US);
+	return true;
+}
+
+/* loosens a throttled cgroup's CPU quota one step */
+static void ias_bw_release(struct cg_stats *cg)
+{
+	cg->quota_us *= 2;
+	if (cg->quota_us < cg->full_quota_us) {
+		ias_bw_write_quota(cg);
+		return;
+	}
+
+	/* back to where it was, so hand back the original limit */
+	if (cg_write_max(cg->path, cg->orig_max))
+		log_warn("bw: could not restore cpu.max of cgroup %s", cg->path);
+	cg->throttled = false;
+	cg_save_throttled();
+	log_info("NOW: %" PRIu64 " | bw: released cgroup %s", now_us, cg->path);
+}
+
+static void ias_bw_restore(struct cg_stats *cg)
+{
+	if (cg_write_max(cg->path, cg->orig_max))
+		log_warn("bw: could not restore cpu.max of cgroup %s", cg->path);
+	else
+		cg->throttled = false;
+}
+
+static void ias_bw_release_all(void)
+{
+	cg_for_each_throttled(ias_bw_restore);
+	/* keeps whatever could not be restored for the next run */
+	cg_save_throttled();
+}
+
+static int ias_bw_cmp_mbps(const void *a, const void *b)
+{
+	const struct cg_stats *x = *(struct cg_stats **)a;
+	const struct cg_stats *y = *(struct cg_stats **)b;
+
+	return (x->mbps < y->mbps) - (x->mbps > y->mbps);
+}
+
+/**
+ * ias_bw_punish - throttles memory bandwidth antagonists
+ *
+ * While the bandwidth is over the limit, the cgroup with the highest
+ * bandwidth that can still be throttled has its CPU quota halved, one
+ * cgroup per window. Once the bandwidth stays below the limit (with some
+ * hysteresis) for a few windows, throttled cgroups get their quota doubled
+ * until they are back to their original limit.
+ */
+static void ias_bw_punish(void)
+{
+	static struct cg_stats *ranked[CG_MAX];
+	static unsigned int calm_windows;
+	unsigned int i;
+
+	if (ias_bw_estimate > ias_bw_thresh) {
+		calm_windows = 0;
+
+		memcpy(ranked, cg_list, cg_nr * sizeof(*ranked));
+		qsort(ranked, cg_nr, sizeof(*ranked), ias_bw_cmp_mbps);
+		for (i = 0; i < cg_nr; i++) {
+			/* the root cgroup can't be limited */
+			if (!strcmp(ranked[i]->path, "/") ||
+			    ranked[i]->unthrottleable)
+				continue;
+			if (ias_bw_throttle(ranked[i]))
+				break;
+		}
+		return;
+	}
+
+	if (ias_bw_estimate > ias_bw_thresh * IAS_BW_HYSTERESIS ||
+	    ++calm_windows < IAS_BW_RELEASE_WINDOWS)
+		return;
+
+	calm_windows = 0;
+	cg_for_each_throttled(ias_bw_release);
+}
+
+/* a moving mean and variance of one signal */
+struct ias_ewma {
+	bool	primed;
+	float	mean;
+	float	var;
+};
+
+/* adds a sample, returns the squared coefficient of variation */
+static float ias_ewma_add(struct ias_ewma *m, float x)
+{
+	float d;
+
+	if (!m->primed) {
+		m->primed = true;
+		m->mean = x;
+		return 0.0;
+	}
+
+	d = x - m->mean;
+	m->mean += IAS_ADAPT_ALPHA * d;
+	m->var = (1.0 - IAS_ADAPT_ALPHA) * (m->var + IAS_ADAPT_ALPHA * d * d);
+	return m->mean > 0 ? m->var / (m->mean * m->mean) : 0.0;
+}
+
+/**
+ * ias_adapt_interval - picks the length of the next sampling window
+ * @work: the TSC cycles counterd just spent on the window
+ *
+ * The window halves when the total bandwidth or the total miss rate varies
+ * a lot between windows, and grows slowly once both are stable again, always
+ * within cfg.ias_interval_min_us and cfg.ias_interval_max_us.
+ *
+ * Sampling costs about the same per window however long it is, so the
+ * window is also kept long enough that neither counterd's own core nor
+ * (on average) the sampled cores spend more than cfg.ias_overhead_budget of
+ * their time on it. The costs are measured: counterd times its own polling,
+ * and the ksched backend reports the time its handlers take on each core.
+ * The budget wins over cfg.ias_interval_max_us.
+ */
+static void ias_adapt_interval(uint64_t work)
+{
+	static struct ias_ewma bw, miss;
+	static uint64_t last_tsc, last_cost, work_total;
+	static unsigned int stable;
+	float cv_bw, cv_miss, self = 0.0, sampling = 0.0, miss_rate = 0.0;
+	uint64_t tsc, cost, elapsed, next;
+	int i;
+
+	work_total += work;
+	tsc = rdtsc();
+	cost = sample_ops->cost ? sample_ops->cost() : 0;
+	elapsed = tsc - last_tsc;
+	if (last_tsc && elapsed) {
+		self = (float)work_total / elapsed;
+		if (sched_cores_nr)
+			sampling = (float)(cost - last_cost) /
+				   ((float)elapsed * sched_cores_nr);
+	}
+	last_tsc = tsc;
+	last_cost = cost;
+	work_total = 0;
+
+	for (i = 0; i < sched_cores_nr; i++)
+		miss_rate += est_win.miss_rate[i];
+	cv_bw = ias_ewma_add(&bw, ias_bw_estimate);
+	cv_miss = ias_ewma_add(&miss, miss_rate);
+
+	next = ias_interval_us;
+	/* both are squared */
+	if (MAX(cv_bw, cv_miss) > IAS_ADAPT_CV_HIGH * IAS_ADAPT_CV_HIGH) {
+		stable = 0;
+		next /= 2;
+	} else if (MAX(cv_bw, cv_miss) < IAS_ADAPT_CV_LOW * IAS_ADAPT_CV_LOW) {
+		if (++stable >= IAS_ADAPT_STABLE_WINDOWS) {
+			stable = 0;
+			next *= IAS_ADAPT_GROW;
+		}
+	} else {
+		stable = 0;
+	}
+	next = MIN(MAX(next, cfg.ias_interval_min_us),
+		   cfg.ias_interval_max_us);
+
+	/* the same cost over a longer window stays within the budget */
+	next = MAX(next, (uint64_t)(ias_interval_us * MAX(self, sampling) /
+				    cfg.ias_overhead_budget));
+
+	log_info("NOW: %" PRIu64 " | Window %" PRIu64 " us - cv^2 bw %.3f, "
+		 "miss rate %.3f, overhead %.3f%% (counterd), %.3f%% "
+		 "(sampling)", now_us, ias_interval_us, cv_bw, cv_miss,
+		 self * 100, sampling * 100);
+	if (next != ias_interval_us)
+		log_info("NOW: %" PRIu64 " | Window now %" PRIu64 " us", now_us,
+			 next);
+	ias_interval_us = next;
 }
 
 /**
  * ias_bw_poll - runs the bandwidth controller
+ *
+ * Returns true if a window was completed.
  */
-void ias_bw_poll(void)
+static bool ias_bw_poll(void)
 {
 	static struct pmc_sample *start = arr_1, *end = arr_2;
 	static int state;
@@ -127,13 +637,13 @@ void ias_bw_poll(void)
 	/* run the state machine */
 	switch (state) {
 	case IAS_BW_STATE_RELAX:
-        ias_bw_request_pmc(PMC_LLC_MISSES, start);
+        ias_bw_request_pmc(start);
         state = IAS_BW_STATE_SAMPLE;
 		break;
 	case IAS_BW_STATE_SAMPLE:
 		state = IAS_BW_STATE_PUNISH;
 		ias_bw_gather_pmc(start);
-		ias_bw_request_pmc(PMC_LLC_MISSES, end);
+		ias_bw_request_pmc(end);
 		break;
 	case IAS_BW_STATE_PUNISH:
 		ias_bw_gather_pmc(end);
@@ -142,32 +652,51 @@ void ias_bw_poll(void)
 			// state = IAS_BW_STATE_RELAX;
 			// break;
 		// }
-		// ias_bw_punish(start, end);
+		ias_measure_bw_mem_ctrl();
 		ias_estimate_bw(start, end);
+		if (cfg.ias_bw_limit)
+			ias_bw_punish();
 		swapvars(start, end);
-		ias_bw_request_pmc(PMC_LLC_MISSES, end);
-		break;
+		subsample_select();
+		ias_bw_request_pmc(end);
+		return true;
 
 	default:
 		panic("ias: invalid bw state");
 	}
+
+	return false;
 }
 
-void ias_sched_poll(uint64_t now) {
+/**
+ * ias_sched_poll - runs the controller if a window step is due
+ * @now: the current time in microseconds
+ *
+ * Returns the time the next step is due.
+ */
+uint64_t ias_sched_poll(uint64_t now) {
 	static uint64_t last_us;
+	uint64_t tsc;
+	bool done;
 	now_us = now;
 
 	/* try to run the subcontroller polling stages */
-	if (now - last_us >= IAS_POLL_INTERVAL_US) {
+	if (ias_bw_enabled &&
+	    now - last_us >= ias_interval_us / cfg.replay_speed) {
 		log_info("start bw polling...");
 		last_us = now;
-		ias_bw_poll();
+		tsc = rdtsc();
+		done = ias_bw_poll();
+		if (cfg.ias_interval_min_us < cfg.ias_interval_max_us && done)
+			ias_adapt_interval(rdtsc() - tsc);
 	}
+
+	return last_us + ias_interval_us / cfg.replay_speed;
 }
 
-void ias_bw_init(void) {
-	int ret;
-	unsigned int nr_channels;
+/* checks whether the counters used by the controller are available */
+static bool ias_bw_hw_supported(void)
+{
 	struct cpuid_info regs;
 	const char *intel_cpu_str = "GenuineIntel";
 	int namebytes[3];
@@ -179,42 +708,122 @@ void ias_bw_init(void) {
 
 	if (memcmp(namebytes, intel_cpu_str, strlen(intel_cpu_str))) {
 		log_warn("Detected non-Intel CPU. Disabling memory bandwidth monitoring!");
-		return 0;
+		return false;
 	}
 
 	cpuid(1, 0, &regs);
 	if (regs.ecx & (1UL << 31UL)) {
 		log_warn("Detected CPU virtualization. Disabling memory bandwidth monitoring!");
+		return false;
+	}
+
+	return true;
+}
+
+/* checks the adaptive window's bounds (both 0 for a fixed window) */
+static void ias_adapt_init(bool replay)
+{
+	if (!cfg.ias_interval_max_us) {
+		cfg.ias_interval_min_us = IAS_POLL_INTERVAL_US;
+		cfg.ias_interval_max_us = IAS_POLL_INTERVAL_US;
+	}
+	if (!cfg.ias_overhead_budget)
+		cfg.ias_overhead_budget = IAS_OVERHEAD_BUDGET;
+
+	/* a trace's windows were cut when it was recorded */
+	if (replay && cfg.ias_interval_min_us < cfg.ias_interval_max_us) {
+		log_warn("ias: a replayed trace keeps its recorded windows");
+		cfg.ias_interval_min_us = IAS_POLL_INTERVAL_US;
+		cfg.ias_interval_max_us = IAS_POLL_INTERVAL_US;
+	}
+	/* shorter windows than the timers would see no new samples */
+	if (cfg.ias_sample == IAS_SAMPLE_TIMER)
+		cfg.ias_interval_min_us = MIN(MAX(cfg.ias_interval_min_us,
+						  cfg.ias_timer_us),
+					      cfg.ias_interval_max_us);
+
+	ias_interval_us = cfg.ias_interval_max_us;
+	if (cfg.ias_interval_min_us < cfg.ias_interval_max_us)
+		log_info("ias: adapting the window between %" PRIu64 " and %"
+			 PRIu64 " us, within %g%% of CPU time",
+			 cfg.ias_interval_min_us, cfg.ias_interval_max_us,
+			 cfg.ias_overhead_budget * 100);
+}
+
+int ias_bw_init(void) {
+	int i, ret, cpu_mhz = cycles_per_us;
+	bool replay = sample_ops == &replay_sample_ops;
+
+	ias_adapt_init(replay);
+
+	/* undo the throttling of a run that was killed */
+	if (!replay)
+		cg_restore_saved();
+
+	/* a replayed trace needs no hardware support */
+	if (!replay && !ias_bw_hw_supported())
 		return 0;
+
+	log_info("Sampling counters with the %s backend", sample_ops->name);
+	/* only ksched knows when a core was idle */
+	if (cfg.ias_idle_skip && sample_ops != &ksched_sample_ops) {
+		log_warn("ias: idleskip needs the ksched backend");
+		cfg.ias_idle_skip = false;
 	}
+	ret = sample_ops->init(ias_pmc_sel, IAS_PMC_NR);
+	if (ret)
+		return ret;
+	est_init();
+
+	memset(ias_core_idx, -1, sizeof(ias_core_idx));
+	for (i = 0; i < sched_cores_nr; i++)
+		ias_core_idx[sched_cores_tbl[i]] = i;
+
+	ret = subsample_init();
+	if (ret)
+		return ret;
 
-	/* ensure threads created by pcm are pinned to control core */
-	pin_thread(0, sched_ctrl_core);
+	/* use the recording machine's parameters */
+	if (replay)
+		cpu_mhz = replay_cycles_per_us;
 
-	ret = pcm_caladan_init(0);
+	ret = mc_init();
 	if (ret)
 		return ret;
 
-	/* We monitor 1 channel, so multiply measurements by nr_channels to estimate real bw */
-	nr_channels = pcm_caladan_get_active_channel_count();
-	if (nr_channels == 0)
-		return -EINVAL;
+	if (cfg.record_path) {
+		ret = record_open(cfg.record_path, mc_nr_sockets,
+				  mc_nr_channels);
+		if (ret)
+			return ret;
+	}
 
-	log_info("Detected nr memory channels = %d", nr_channels);
-	log_info("Detected cycles per us = %d", cycles_per_us);
+	log_info("Detected nr sockets = %d", mc_nr_sockets);
+	log_info("Detected cycles per us = %d", cpu_mhz);
 	log_info("Detected cache line size = %d", CACHE_LINE_SIZE);
 
-	// /* Use default limit if none supplied */
-	// if (!cfg.ias_bw_limit)
-	// 	cfg.ias_bw_limit = IAS_BW_LIMIT;
 
-	/* Compute the multiplier to convert cache lines/cycle to bytes/us (= MB/s) */
-	ias_bw_estimate_multiplier = cycles_per_us * nr_channels * CACHE_LINE_SIZE;
+	/*
+	 * Compute the multiplier to convert cache lines/cycle to bytes/us
+	 * (= MB/s). Every active channel is sampled, so no scaling is needed.
+	 */
+	ias_bw_estimate_multiplier = cpu_mhz * CACHE_LINE_SIZE;
 
 	log_info("bw estimate multiplier = %.2f", ias_bw_estimate_multiplier);
 
-	/* convert from MB/s to per channel cache line/cycle */
-	// ias_bw_thresh = cfg.ias_bw_limit / ias_bw_estimate_multiplier;
+	/* convert from MB/s to cache line/cycle */
+	if (cfg.ias_bw_limit && cfg.replay_path) {
+		log_warn("bw: a replayed trace has no cgroups to throttle");
+		cfg.ias_bw_limit = 0;
+	}
+	if (cfg.ias_bw_limit) {
+		ias_bw_thresh = cfg.ias_bw_limit / ias_bw_estimate_multiplier;
+		log_info("bw limit = %.1f MB/s, throttling cgroups above it",
+			 cfg.ias_bw_limit);
+		/* never leave cgroups throttled behind us */
+		atexit(ias_bw_release_all);
+	}
 
+	ias_bw_enabled = true;
 	return 0;
 }
@@ -0,0 +1,384 @@
+/*
+ * cgroup.c - rolls per-process counters up to their cgroups
+ *
+ * A process's cgroup is read from /proc/<pid>/cgroup the first time it is
+ * seen and cached by TGID. Entries of processes that were not seen for
+ * CG_CACHE_TTL windows are dropped, so the cache follows exits (and a
+ * recycled PID is looked up again once its predecessor ages out).
+ *
+ * A cgroup no process was seen in for CG_CACHE_TTL windows gets its cpu.max
+ * and resctrl groups back, and its entry is reused, so the table follows
+ * containers that come and go. No cached process still points to it then.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <base/stddef.h>
+#include <base/hash.h>
+#include <base/log.h>
+
+#include "defs.h"
+#include "cgroup.h"
+#include "resctrl.h"
+
+#define CG_ROOT_PATH		"/sys/fs/cgroup"
+/* cached processes (must be a power of two) */
+#define CG_CACHE_SIZE		8192
+#define CG_CACHE_MASK		(CG_CACHE_SIZE - 1)
+/* windows a process may go unseen before its cache entry is dropped */
+#define CG_CACHE_TTL		50
+/* the original cpu.max of throttled cgroups, in case counterd is killed */
+#define CG_SAVED_PATH		"/run/counterd.throttled"
+
+struct cg_cache_ent {
+	uint32_t	tgid;		/* zero if the slot is free */
+	uint32_t	last_seen;	/* the window the process was last seen */
+	struct cg_stats	*cg;		/* NULL if the process has exited */
+};
+
+static struct cg_cache_ent cg_cache[CG_CACHE_SIZE];
+static struct cg_stats cg_tbl[CG_MAX];
+static unsigned int cg_tbl_nr;
+static uint32_t cg_gen;
+
+/* the cgroups seen in the current window */
+struct cg_stats *cg_list[CG_MAX];
+unsigned int cg_nr;
+
+/* finds (or adds) the cgroup with a path */
+static struct cg_stats *cg_lookup_path(const char *path)
+{
+	char full[PATH_MAX + sizeof(CG_ROOT_PATH)];
+	struct cg_stats *cg = NULL;
+	struct stat st;
+	unsigned int i;
+	size_t len;
+
+	for (i = 0; i < cg_tbl_nr; i++) {
+		if (!strcmp(cg_tbl[i].path, path))
+			return &cg_tbl[i];
+		/* an empty path marks a reclaimed entry */
+		if (!cg && !cg_tbl[i].path[0])
+			cg = &cg_tbl[i];
+	}
+
+	if (!cg && cg_tbl_nr >= CG_MAX) {
+		log_warn_once("cgroup: more than %d cgroups, ignoring the rest",
+			      CG_MAX);
+		return NULL;
+	}
+
+	if (!cg)
+		cg = &cg_tbl[cg_tbl_nr++];
+	len = MIN(strlen(path), sizeof(cg->path) - 1);
+	memcpy(cg->path, path, len);
+	cg->path[len] = '\0';
+	memcpy(full, CG_ROOT_PATH, sizeof(CG_ROOT_PATH) - 1);
+	memcpy(full + sizeof(CG_ROOT_PATH) - 1, cg->path, len + 1);
+	cg->id = stat(full, &st) ? 0 : st.st_ino;
+	return cg;
+}
+
+/* reads the cgroup v2 path of a process */
+static struct cg_stats *cg_resolve(uint32_t tgid)
+{
+	char path[64], line[PATH_MAX];
+	struct cg_stats *cg = NULL;
+	FILE *f;
+	size_t len;
+
+	snprintf(path, sizeof(path), "/proc/%u/cgroup", tgid);
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+
+	while (fgets(line, sizeof(line), f)) {
+		/* the unified hierarchy is "0::<path>" */
+		if (strncmp(line, "0::", 3))
+			continue;
+		len = strlen(line);
+		if (len && line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		cg = cg_lookup_path(line + 3);
+		break;
+	}
+
+	fclose(f);
+	return cg;
+}
+
+static struct cg_cache_ent *cg_cache_lookup(uint32_t tgid)
+{
+	struct cg_cache_ent *ent, *free = NULL;
+	uint32_t idx, i;
+
+	idx = hash_crc32c_one(0, tgid) & CG_CACHE_MASK;
+	for (i = 0; i < CG_CACHE_SIZE; i++) {
+		ent = &cg_cache[(idx + i) & CG_CACHE_MASK];
+		if (ent->tgid == tgid) {
+			/* an expired entry may belong to a recycled PID */
+			if (cg_gen - ent->last_seen > CG_CACHE_TTL)
+				ent->cg = cg_resolve(tgid);
+			return ent;
+		}
+		if (!free && (!ent->tgid ||
+			      cg_gen - ent->last_seen > CG_CACHE_TTL))
+			free = ent;
+		if (!ent->tgid)
+			break;
+	}
+
+	if (!free)
+		return NULL;
+	free->tgid = tgid;
+	free->cg = cg_resolve(tgid);
+	return free;
+}
+
+/**
+ * cg_open - opens a cgroup's interface file
+ * @cgroup: the cgroup's path
+ * @file: the file's name (e.g. "cpu.max")
+ * @flags: the open() flags
+ *
+ * Returns a file descriptor, or -1 on error (with errno set).
+ */
+int cg_open(const char *cgroup, const char *file, int flags)
+{
+	char path[PATH_MAX + sizeof(CG_ROOT_PATH) + 16];
+
+	snprintf(path, sizeof(path), "%s%s/%s", CG_ROOT_PATH, cgroup, file);
+	return open(path, flags | O_CLOEXEC);
+}
+
+/**
+ * cg_read_usage - reads the CPU time used by a cgroup
+ * @cgroup: the cgroup's path
+ * @usage_us: set to the usage in microseconds
+ *
+ * Returns 0 if successful.
+ */
+int cg_read_usage(const char *cgroup, uint64_t *usage_us)
+{
+	char buf[256];
+	ssize_t ret;
+	int fd;
+
+	fd = cg_open(cgroup, "cpu.stat", O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	ret = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (ret <= 0)
+		return -EIO;
+	buf[ret] = '\0';
+
+	/* usage_usec is always the first key */
+	if (sscanf(buf, "usage_usec %" SCNu64, usage_us) != 1)
+		return -EINVAL;
+	return 0;
+}
+
+/**
+ * cg_read_max - reads a cgroup's CPU bandwidth limit (cpu.max)
+ * @cgroup: the cgroup's path
+ * @buf: the buffer to store the limit
+ * @len: the size of @buf
+ *
+ * Returns 0 if successful.
+ */
+int cg_read_max(const char *cgroup, char *buf, size_t len)
+{
+	ssize_t ret;
+	int fd;
+
+	fd = cg_open(cgroup, "cpu.max", O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	ret = read(fd, buf, len - 1);
+	close(fd);
+	if (ret <= 0)
+		return -EIO;
+	buf[ret] = '\0';
+	return 0;
+}
+
+/**
+ * cg_write_max - sets a cgroup's CPU bandwidth limit (cpu.max)
+ * @cgroup: the cgroup's path
+ * @max: the limit ("<quota> <period>" or "max <period>")
+ *
+ * Only logs the change in a dry run. Returns 0 if successful.
+ */
+int cg_write_max(const char *cgroup, const char *max)
+{
+	ssize_t ret;
+	int fd;
+
+	if (cfg.dry_run) {
+		log_info("cgroup: would set cpu.max of %s to %s", cgroup, max);
+		return 0;
+	}
+
+	fd = cg_open(cgroup, "cpu.max", O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	ret = write(fd, max, strlen(max));
+	close(fd);
+	return ret < 0 ? -errno : 0;
+}
+
+/**
+ * cg_for_each_throttled - calls a function on every throttled cgroup
+ * @fn: the function
+ */
+void cg_for_each_throttled(void (*fn)(struct cg_stats *cg))
+{
+	unsigned int i;
+
+	for (i = 0; i < cg_tbl_nr; i++) {
+		if (cg_tbl[i].throttled)
+			fn(&cg_tbl[i]);
+	}
+}
+
+/**
+ * cg_save_throttled - records the original cpu.max of throttled cgroups
+ *
+ * Rewrites CG_SAVED_PATH with a "<cgroup>\t<cpu.max>" line per throttled
+ * cgroup, or removes it if none is. A restart hands these limits back with
+ * cg_restore_saved() should counterd die without restoring them itself.
+ */
+void cg_save_throttled(void)
+{
+	unsigned int i, nr = 0;
+	FILE *f;
+
+	if (cfg.dry_run)
+		return;
+
+	f = fopen(CG_SAVED_PATH ".tmp", "w");
+	if (!f) {
+		log_warn_once("cgroup: could not save cpu.max to %s (%s)",
+			      CG_SAVED_PATH, strerror(errno));
+		return;
+	}
+	for (i = 0; i < cg_tbl_nr; i++) {
+		if (!cg_tbl[i].throttled)
+			continue;
+		fprintf(f, "%s\t%s\n", cg_tbl[i].path, cg_tbl[i].orig_max);
+		nr++;
+	}
+	if (fclose(f) || !nr) {
+		unlink(CG_SAVED_PATH ".tmp");
+		if (!nr)
+			unlink(CG_SAVED_PATH);
+		return;
+	}
+	rename(CG_SAVED_PATH ".tmp", CG_SAVED_PATH);
+}
+
+/**
+ * cg_restore_saved - hands back limits a previous run left throttled
+ */
+void cg_restore_saved(void)
+{
+	char line[PATH_MAX + 80], *max;
+	FILE *f;
+
+	if (cfg.dry_run)
+		return;
+
+	f = fopen(CG_SAVED_PATH, "r");
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		max = strchr(line, '\t');
+		if (!max)
+			continue;
+		*max++ = '\0';
+		if (cg_write_max(line, max))
+			log_warn("cgroup: could not restore cpu.max of %s", line);
+		else
+			log_info("cgroup: restored cpu.max of %s to %s", line,
+				 max);
+	}
+	fclose(f);
+	unlink(CG_SAVED_PATH);
+}
+
+/**
+ * cg_begin_window - forgets the rollups of the previous window
+ */
+void cg_begin_window(void)
+{
+	struct cg_stats *cg;
+	bool released = false;
+	unsigned int i;
+
+	cg_gen++;
+	cg_nr = 0;
+
+	/* the cache expires its processes after as many windows */
+	for (i = 0; i < cg_tbl_nr; i++) {
+		cg = &cg_tbl[i];
+		if (!cg->path[0] || cg_gen - cg->gen <= CG_CACHE_TTL)
+			continue;
+
+		/* the cgroup is most likely gone, so this may well fail */
+		if (cg->throttled) {
+			cg_write_max(cg->path, cg->orig_max);
+			cg->throttled = false;
+			released = true;
+		}
+		rdt_release(cg);
+		memset(cg, 0, sizeof(*cg));
+	}
+	if (released)
+		cg_save_throttled();
+}
+
+/**
+ * cg_account - adds a process's share of the window to its cgroup
+ * @tgid: the process
+ * @misses: the process's LLC misses in the window
+ * @instrs: the process's instructions retired in the window
+ * @mbps: the process's estimated DRAM bandwidth in the window
+ */
+void cg_account(uint32_t tgid, uint64_t misses, uint64_t instrs, float mbps)
+{
+	struct cg_cache_ent *ent;
+	struct cg_stats *cg;
+
+	if (!tgid)
+		return;
+
+	ent = cg_cache_lookup(tgid);
+	if (!ent)
+		return;
+	ent->last_seen = cg_gen;
+	cg = ent->cg;
+	if (!cg)
+		return;
+
+	if (cg->gen != cg_gen) {
+		cg->gen = cg_gen;
+		cg->nr_procs = 0;
+		cg->misses = cg->instrs = cg->bytes = 0;
+		cg->mbps = 0.0;
+		cg_list[cg_nr++] = cg;
+	}
+
+	cg->nr_procs++;
+	cg->misses += misses;
+	cg->instrs += instrs;
+	cg->bytes += misses * CACHE_LINE_SIZE;
+	cg->mbps += mbps;
+}
@@ -0,0 +1,69 @@
+/*
+ * cgroup.h - rolls per-process counters up to their cgroups
+ */
+
+#pragma once
+
+#include <limits.h>
+
+#include <base/stddef.h>
+
+/* the most cgroups reported per window */
+#define CG_MAX			256
+
+/* one cgroup's share of a window */
+struct cg_stats {
+	char		path[PATH_MAX];	/* relative to the cgroup v2 root */
+	uint64_t	id;		/* the cgroup directory's inode */
+	uint32_t	gen;		/* the window this rollup belongs to */
+	unsigned int	nr_procs;
+	uint64_t	misses;
+	uint64_t	instrs;
+	uint64_t	bytes;		/* estimated DRAM traffic (misses) */
+	float		mbps;
+
+	/* bandwidth throttling state (see ias_bw_punish()) */
+	bool		throttled;
+	bool		unthrottleable;	/* cpu.max could not be written */
+	uint64_t	quota_us;	/* the cpu.max quota while throttled */
+	uint64_t	full_quota_us;	/* the quota matching its usage before */
+	char		orig_max[64];	/* cpu.max before it was throttled */
+	uint64_t	usage_us;	/* cpu.stat usage at @usage_at_us */
+	uint64_t	usage_at_us;
+
+	/* resctrl monitoring state (see resctrl.c) */
+	bool		rdt_mon;	/* has a monitoring group */
+	bool		rdt_failed;	/* no group could be created */
+	unsigned int	rdt_sync;	/* windows until its tasks are synced */
+	uint64_t	llc_occupancy;	/* bytes of LLC held at the window end */
+	uint64_t	mbm_total;	/* cumulative bytes at @mbm_at_us */
+	uint64_t	mbm_local;
+	uint64_t	mbm_at_us;
+	float		mbm_total_mbps;	/* memory bandwidth in the window */
+	float		mbm_local_mbps;	/* ... of which to the local socket */
+
+	/* resctrl partitioning state (see rdt_ctrl_step()) */
+	bool		rdt_partitioned; /* restricted (maybe only a dry run) */
+	bool		rdt_ctrl;	/* has its own control group */
+	unsigned int	rdt_ways;	/* LLC ways it may allocate into */
+	unsigned int	rdt_mba;	/* memory bandwidth allowed (%) */
+	float		rdt_last_mpki;	/* MPKI over the previous period */
+	unsigned int	rdt_windows;	/* windows seen in the current period */
+	uint64_t	rdt_misses;	/* ... and their LLC misses */
+	uint64_t	rdt_instrs;
+	float		rdt_mbps;	/* ... and their summed bandwidth */
+};
+
+extern struct cg_stats *cg_list[];
+extern unsigned int cg_nr;
+
+extern void cg_begin_window(void);
+extern int cg_open(const char *cgroup, const char *file, int flags);
+extern int cg_read_usage(const char *cgroup, uint64_t *usage_us);
+extern int cg_read_max(const char *cgroup, char *buf, size_t len);
+extern int cg_write_max(const char *cgroup, const char *max);
+extern void cg_for_each_throttled(void (*fn)(struct cg_stats *cg));
+extern void cg_save_throttled(void);
+extern void cg_restore_saved(void);
+extern void cg_account(uint32_t tgid, uint64_t misses, uint64_t instrs,
+		       float mbps);
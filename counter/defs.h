@@ -38,6 +38,60 @@
 // };
 
 // extern struct iokernel_cfg cfg;
+
+/*
+ * configuration parameters
+ */
+
+enum {
+	IAS_NORM_TSC = 0,	/* divide by elapsed TSC cycles (wall-clock) */
+	IAS_NORM_REF_CYCLES,	/* divide by unhalted reference cycles */
+	IAS_NORM_MPERF,		/* divide by MPERF (C0 cycles at TSC rate) */
+};
+
+enum {
+	IAS_SAMPLE_IPI = 0,	/* asynchronous IPIs, polled a window later */
+	IAS_SAMPLE_TIMER,	/* per-CPU kernel timers filling shared rings */
+	IAS_SAMPLE_SYNC,	/* one synchronous ioctl per window */
+};
+
+enum {
+	PUBLISH_MEMFD = 0,	/* a sealed memfd handed out over a unix socket */
+	PUBLISH_SYSV,		/* a System V segment at COUNTER_SHM_KEY */
+	PUBLISH_NONE,		/* only log results */
+};
+
+enum {
+	WAIT_SPIN = 0,		/* spin on the TSC */
+	WAIT_TPAUSE,		/* tpause, leaving the core to the sibling */
+	WAIT_SLEEP,		/* clock_nanosleep(), then spin the rest */
+};
+
+struct counter_cfg {
+	int		ias_norm; /* the denominator used for the decision miss rate */
+	int		ias_sample; /* how counters are sampled on each core */
+	uint64_t	ias_timer_us; /* kernel sampling timer period */
+	const char	*replay_path; /* a trace to replay instead of sampling */
+	const char	*record_path; /* a trace to record gathered samples to */
+	unsigned int	replay_speed; /* how many times faster to replay */
+	int		publish; /* how the window ring is shared */
+	float		ias_bw_limit; /* IAS bw limit, (MB/s), 0 to not throttle */
+	const char	*policy_path; /* a scheduling policy to load */
+	const char	*policy_args; /* the argument string passed to it */
+	bool		rdt; /* monitor cgroups with resctrl (CMT/MBM) */
+	const char	*resctrl_root; /* where resctrl is mounted */
+	float		rdt_partition_mbps; /* partition cgroups above (MB/s) */
+	bool		dry_run; /* log actuator changes instead of making them */
+	bool		ias_ht; /* also report per physical core (SMT pairs) */
+	uint64_t	ias_interval_min_us; /* the shortest sampling window */
+	uint64_t	ias_interval_max_us; /* the longest, 0 for the default */
+	float		ias_overhead_budget; /* the CPU share sampling may take */
+	unsigned int	ias_subsample; /* cores sampled per LLC, 0 for all */
+	bool		ias_idle_skip; /* don't interrupt cores idle all window */
+	int		wait; /* how the main loop waits between deadlines */
+};
+
+extern struct counter_cfg cfg;
 // extern uint32_t nr_vfio_prealloc;
 // extern unsigned int vfio_prealloc_nrqs;
 // extern bool vfio_prealloc_rmp;
@@ -0,0 +1,246 @@
+/*
+ * estimate.c - per-window counter deltas and rates for every sampled core
+ *
+ * The kernel subtracts two snapshots, corrects the deltas of the 48-bit
+ * counters for wrap-around, and derives the rates of every core. It runs
+ * with AVX-512 or AVX2 when the CPU has them (chosen once at startup, since
+ * counterd isn't built for a specific CPU), otherwise with plain C.
+ */
+
+#include <immintrin.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+
+#include "defs.h"
+#include "estimate.h"
+
+/* the general-purpose and fixed counters are 48 bits wide */
+#define EST_CTR_MASK		((1UL << 48) - 1)
+
+struct est_window est_win;
+
+static inline float est_div(uint64_t a, uint64_t b)
+{
+	return b ? (float)((double)a / (double)b) : 0.0;
+}
+
+static void est_compute_scalar(const struct est_snapshot *s,
+			       const struct est_snapshot *e,
+			       unsigned int start, unsigned int nr)
+{
+	struct est_window *w = &est_win;
+	uint64_t busy_mask;
+	unsigned int i;
+
+	/* MPERF is a 64-bit MSR */
+	busy_mask = cfg.ias_norm == IAS_NORM_MPERF ? ~0UL : EST_CTR_MASK;
+
+	for (i = start; i < nr; i++) {
+		w->tsc[i] = e->tsc[i] - s->tsc[i];
+		w->misses[i] = (e->misses[i] - s->misses[i]) & EST_CTR_MASK;
+		w->refs[i] = (e->refs[i] - s->refs[i]) & EST_CTR_MASK;
+		w->instrs[i] = (e->instrs[i] - s->instrs[i]) & EST_CTR_MASK;
+		w->cycles[i] = (e->cycles[i] - s->cycles[i]) & EST_CTR_MASK;
+		w->busy_cycles[i] = (e->busy[i] - s->busy[i]) & busy_mask;
+
+		w->miss_rate[i] = est_div(w->misses[i], w->tsc[i]);
+		w->busy_miss_rate[i] = est_div(w->misses[i], w->busy_cycles[i]);
+		w->busy[i] = MIN(est_div(w->busy_cycles[i], w->tsc[i]), 1.0);
+		w->miss_ratio[i] = est_div(w->misses[i], w->refs[i]);
+		w->mpki[i] = est_div(w->misses[i] * 1000, w->instrs[i]);
+		w->ipc[i] = est_div(w->instrs[i], w->cycles[i]);
+		w->l2_miss_rate[i] = est_div(w->refs[i], w->tsc[i]);
+		w->rate[i] = cfg.ias_norm == IAS_NORM_TSC ?
+			     w->miss_rate[i] : w->busy_miss_rate[i];
+	}
+}
+
+/* picked by est_init(), plain C until then */
+static void (*est_kernel)(const struct est_snapshot *s,
+			  const struct est_snapshot *e, unsigned int start,
+			  unsigned int nr) = est_compute_scalar;
+
+/* converts unsigned 64-bit integers to doubles (AVX2 has no instruction) */
+__attribute__((target("avx2")))
+static inline __m256d est_u64_to_pd(__m256i v)
+{
+	const __m256i lo_magic = _mm256_set1_epi64x(0x4330000000000000);
+	const __m256i hi_magic = _mm256_set1_epi64x(0x4530000000000000);
+	const __m256d magic = _mm256_set1_pd(19342813118337666422669312.0);
+	__m256i lo, hi;
+
+	/* 2^52 + the low half, and 2^84 + the high half * 2^32 */
+	lo = _mm256_blend_epi32(lo_magic, v, 0x55);
+	hi = _mm256_or_si256(_mm256_srli_epi64(v, 32), hi_magic);
+	return _mm256_add_pd(_mm256_sub_pd(_mm256_castsi256_pd(hi), magic),
+			     _mm256_castsi256_pd(lo));
+}
+
+/* a / b, or 0 where b is 0 */
+__attribute__((target("avx2")))
+static inline __m128 est_div_pd(__m256d a, __m256d b)
+{
+	__m256d zero = _mm256_cmp_pd(b, _mm256_setzero_pd(), _CMP_EQ_OQ);
+
+	return _mm256_cvtpd_ps(_mm256_andnot_pd(zero, _mm256_div_pd(a, b)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i est_delta_avx2(const uint64_t *s, const uint64_t *e,
+				     uint64_t *out, __m256i mask)
+{
+	__m256i d = _mm256_and_si256(_mm256_sub_epi64(_mm256_loadu_si256((void *)e),
+						      _mm256_loadu_si256((void *)s)),
+				     mask);
+
+	_mm256_storeu_si256((void *)out, d);
+	return d;
+}
+
+__attribute__((target("avx2")))
+static void est_compute_avx2(const struct est_snapshot *s,
+			     const struct est_snapshot *e,
+			     unsigned int start, unsigned int nr)
+{
+	struct est_window *w = &est_win;
+	const __m256i ctr_mask = _mm256_set1_epi64x(EST_CTR_MASK);
+	const __m256i all = _mm256_set1_epi64x(-1);
+	const __m256d kilo = _mm256_set1_pd(1000.0);
+	__m256i busy_mask = cfg.ias_norm == IAS_NORM_MPERF ? all : ctr_mask;
+	bool norm_tsc = cfg.ias_norm == IAS_NORM_TSC;
+	__m256d tsc, misses, refs, instrs, cycles, busy;
+	__m128 miss_rate, busy_miss_rate;
+	unsigned int i;
+
+	for (i = start; i + 4 <= nr; i += 4) {
+		tsc = est_u64_to_pd(est_delta_avx2(&s->tsc[i], &e->tsc[i],
+						   &w->tsc[i], all));
+		misses = est_u64_to_pd(est_delta_avx2(&s->misses[i],
+				&e->misses[i], &w->misses[i], ctr_mask));
+		refs = est_u64_to_pd(est_delta_avx2(&s->refs[i], &e->refs[i],
+						    &w->refs[i], ctr_mask));
+		instrs = est_u64_to_pd(est_delta_avx2(&s->instrs[i],
+				&e->instrs[i], &w->instrs[i], ctr_mask));
+		cycles = est_u64_to_pd(est_delta_avx2(&s->cycles[i],
+				&e->cycles[i], &w->cycles[i], ctr_mask));
+		busy = est_u64_to_pd(est_delta_avx2(&s->busy[i], &e->busy[i],
+				&w->busy_cycles[i], busy_mask));
+
+		miss_rate = est_div_pd(misses, tsc);
+		busy_miss_rate = est_div_pd(misses, busy);
+		_mm_storeu_ps(&w->miss_rate[i], miss_rate);
+		_mm_storeu_ps(&w->busy_miss_rate[i], busy_miss_rate);
+		_mm_storeu_ps(&w->rate[i], norm_tsc ? miss_rate : busy_miss_rate);
+		_mm_storeu_ps(&w->busy[i],
+			      _mm_min_ps(est_div_pd(busy, tsc), _mm_set1_ps(1.0)));
+		_mm_storeu_ps(&w->miss_ratio[i], est_div_pd(misses, refs));
+		_mm_storeu_ps(&w->mpki[i],
+			      est_div_pd(_mm256_mul_pd(misses, kilo), instrs));
+		_mm_storeu_ps(&w->ipc[i], est_div_pd(instrs, cycles));
+		_mm_storeu_ps(&w->l2_miss_rate[i], est_div_pd(refs, tsc));
+	}
+
+	est_compute_scalar(s, e, i, nr);
+}
+
+/* a / b, or 0 where b is 0 */
+__attribute__((target("avx512f,avx512dq")))
+static inline __m256 est_div_pd512(__m512d a, __m512d b)
+{
+	__mmask8 nonzero = _mm512_cmp_pd_mask(b, _mm512_setzero_pd(),
+					      _CMP_NEQ_OQ);
+
+	return _mm512_cvtpd_ps(_mm512_maskz_div_pd(nonzero, a, b));
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static inline __m512d est_delta_avx512(const uint64_t *s, const uint64_t *e,
+				       uint64_t *out, __m512i mask)
+{
+	__m512i d = _mm512_and_si512(_mm512_sub_epi64(_mm512_loadu_si512(e),
+						      _mm512_loadu_si512(s)),
+				     mask);
+
+	_mm512_storeu_si512(out, d);
+	return _mm512_cvtepu64_pd(d);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static void est_compute_avx512(const struct est_snapshot *s,
+			       const struct est_snapshot *e,
+			       unsigned int start, unsigned int nr)
+{
+	struct est_window *w = &est_win;
+	const __m512i ctr_mask = _mm512_set1_epi64(EST_CTR_MASK);
+	const __m512i all = _mm512_set1_epi64(-1);
+	const __m512d kilo = _mm512_set1_pd(1000.0);
+	__m512i busy_mask = cfg.ias_norm == IAS_NORM_MPERF ? all : ctr_mask;
+	bool norm_tsc = cfg.ias_norm == IAS_NORM_TSC;
+	__m512d tsc, misses, refs, instrs, cycles, busy;
+	__m256 miss_rate, busy_miss_rate;
+	unsigned int i;
+
+	for (i = start; i + 8 <= nr; i += 8) {
+		tsc = est_delta_avx512(&s->tsc[i], &e->tsc[i], &w->tsc[i], all);
+		misses = est_delta_avx512(&s->misses[i], &e->misses[i],
+					  &w->misses[i], ctr_mask);
+		refs = est_delta_avx512(&s->refs[i], &e->refs[i], &w->refs[i],
+					ctr_mask);
+		instrs = est_delta_avx512(&s->instrs[i], &e->instrs[i],
+					  &w->instrs[i], ctr_mask);
+		cycles = est_delta_avx512(&s->cycles[i], &e->cycles[i],
+					  &w->cycles[i], ctr_mask);
+		busy = est_delta_avx512(&s->busy[i], &e->busy[i],
+					&w->busy_cycles[i], busy_mask);
+
+		miss_rate = est_div_pd512(misses, tsc);
+		busy_miss_rate = est_div_pd512(misses, busy);
+		_mm256_storeu_ps(&w->miss_rate[i], miss_rate);
+		_mm256_storeu_ps(&w->busy_miss_rate[i], busy_miss_rate);
+		_mm256_storeu_ps(&w->rate[i],
+				 norm_tsc ? miss_rate : busy_miss_rate);
+		_mm256_storeu_ps(&w->busy[i],
+				 _mm256_min_ps(est_div_pd512(busy, tsc),
+					       _mm256_set1_ps(1.0)));
+		_mm256_storeu_ps(&w->miss_ratio[i], est_div_pd512(misses, refs));
+		_mm256_storeu_ps(&w->mpki[i],
+				 est_div_pd512(_mm512_mul_pd(misses, kilo),
+					       instrs));
+		_mm256_storeu_ps(&w->ipc[i], est_div_pd512(instrs, cycles));
+		_mm256_storeu_ps(&w->l2_miss_rate[i], est_div_pd512(refs, tsc));
+	}
+
+	est_compute_scalar(s, e, i, nr);
+}
+
+/**
+ * est_compute - computes the deltas and rates of a window into est_win
+ * @s: the snapshot at the start of the window
+ * @e: the snapshot at the end of the window
+ * @nr: the number of cores in the snapshots
+ */
+void est_compute(const struct est_snapshot *s, const struct est_snapshot *e,
+		 unsigned int nr)
+{
+	est_kernel(s, e, 0, nr);
+}
+
+/**
+ * est_init - picks the widest kernel the CPU supports
+ */
+void est_init(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("avx512dq")) {
+		est_kernel = est_compute_avx512;
+		log_info("estimate: using the AVX-512 kernel");
+	} else if (__builtin_cpu_supports("avx2")) {
+		est_kernel = est_compute_avx2;
+		log_info("estimate: using the AVX2 kernel");
+	} else {
+		est_kernel = est_compute_scalar;
+		log_info("estimate: using the scalar kernel");
+	}
+}
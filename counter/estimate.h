@@ -0,0 +1,54 @@
+/*
+ * estimate.h - per-window counter deltas and rates for every sampled core
+ */
+
+#pragma once
+
+#include <base/stddef.h>
+#include <base/limits.h>
+
+/*
+ * Both structures are indexed by a core's position in sched_cores_tbl, so
+ * every field is one contiguous array over the sampled cores.
+ */
+
+/* every sampled core's counters at a window boundary */
+struct est_snapshot {
+	uint64_t	tsc[NCPU];
+	uint64_t	misses[NCPU];
+	uint64_t	refs[NCPU];
+	uint64_t	instrs[NCPU];
+	uint64_t	cycles[NCPU];
+	uint64_t	busy[NCPU];	/* unhalted cycles at the TSC rate */
+} __aligned(CACHE_LINE_SIZE);
+
+/* every sampled core's results over a window */
+struct est_window {
+	/* counter deltas */
+	uint64_t	tsc[NCPU];
+	uint64_t	misses[NCPU];
+	uint64_t	refs[NCPU];
+	uint64_t	instrs[NCPU];
+	uint64_t	cycles[NCPU];
+	uint64_t	busy_cycles[NCPU];
+
+	/* derived rates */
+	float		miss_rate[NCPU];	/* LLC misses per TSC cycle */
+	float		busy_miss_rate[NCPU];	/* LLC misses per unhalted cycle */
+	float		busy[NCPU];		/* fraction of the window unhalted */
+	float		rate[NCPU];		/* the one selected by cfg.ias_norm */
+	float		miss_ratio[NCPU];	/* LLC misses per LLC reference */
+	float		mpki[NCPU];		/* LLC misses per kilo-instruction */
+	float		ipc[NCPU];		/* instructions per core cycle */
+	float		l2_miss_rate[NCPU];	/* LLC references per TSC cycle */
+	float		pair_miss_rate[NCPU];	/* physical core's (with ht) */
+
+	/* 0 if the core sat the window out (see subsample.c) */
+	uint8_t		sampled[NCPU];
+} __aligned(CACHE_LINE_SIZE);
+
+extern struct est_window est_win;
+
+extern void est_init(void);
+extern void est_compute(const struct est_snapshot *s,
+			const struct est_snapshot *e, unsigned int nr);
@@ -0,0 +1,113 @@
+/*
+ * ht.c - idles hyperthreads on behalf of policies
+ *
+ * counterd can't park a core the way the IOKernel parked its kthreads, so a
+ * core is idled by running a SCHED_FIFO thread on it that parks itself with
+ * tpause (or spins on pause without it), leaving the physical core's shared
+ * resources (L1, L2, execution ports) to its sibling. One idler is created per core on first use; it
+ * sleeps on a condition variable between idle periods.
+ *
+ * The idler runs at the lowest real-time priority, so kernel threads and
+ * other real-time tasks still get the core, and a request idles a core for
+ * at most one window. A policy that wants a core idled longer asks again.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/atomic.h>
+#include <base/log.h>
+#include <base/time.h>
+
+#include "defs.h"
+#include "sched.h"
+#include "ht.h"
+#include "wait.h"
+
+struct ht_idler {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	uint64_t	until_tsc;	/* idle until this TSC, 0 when asleep */
+	unsigned int	core;
+	bool		started;
+};
+
+static struct ht_idler ht_idlers[NCPU];
+
+static void *ht_idler_thread(void *arg)
+{
+	struct ht_idler *h = arg;
+	struct sched_param param;
+	uint64_t until;
+
+	pin_thread(0, h->core);
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+		log_warn_once("ht: idlers can't run SCHED_FIFO, other threads "
+			      "may still run on idled cores");
+
+	pthread_mutex_lock(&h->lock);
+	while (true) {
+		while (!h->until_tsc)
+			pthread_cond_wait(&h->cond, &h->lock);
+		pthread_mutex_unlock(&h->lock);
+
+		/* the period may be extended while we are parked */
+		while (rdtsc() < (until = load_acquire(&h->until_tsc)))
+			wait_park(until);
+
+		pthread_mutex_lock(&h->lock);
+		if (rdtsc() >= h->until_tsc)
+			h->until_tsc = 0;
+	}
+
+	return NULL;
+}
+
+/**
+ * ht_idle - keeps a core idle for a while
+ * @core: the core (normally the hyperthread sibling of a victim)
+ * @us: how long to idle it, at most one window (ias_interval_us)
+ *
+ * Extends the idle period if the core is already idle. Only logs the request
+ * when replaying or in a dry run. Returns 0 if successful.
+ */
+int ht_idle(unsigned int core, uint64_t us)
+{
+	struct ht_idler *h;
+	pthread_t tid;
+	uint64_t until;
+	int ret;
+
+	/* never idle counterd's own cores (the ring's server runs on control) */
+	if (core >= NCPU || core == sched_ctrl_core || core == sched_dp_core)
+		return -EINVAL;
+	if (cfg.replay_path || cfg.dry_run) {
+		log_info("ht: would idle core %u for %" PRIu64 " us", core, us);
+		return 0;
+	}
+
+	h = &ht_idlers[core];
+	if (!h->started) {
+		pthread_mutex_init(&h->lock, NULL);
+		pthread_cond_init(&h->cond, NULL);
+		h->core = core;
+		ret = -pthread_create(&tid, NULL, ht_idler_thread, h);
+		if (ret)
+			return ret;
+		pthread_detach(tid);
+		h->started = true;
+	}
+
+	until = rdtsc() + MIN(us, ias_interval_us) * cycles_per_us;
+	pthread_mutex_lock(&h->lock);
+	if (until > h->until_tsc)
+		store_release(&h->until_tsc, until);
+	pthread_cond_signal(&h->cond);
+	pthread_mutex_unlock(&h->lock);
+	return 0;
+}
@@ -0,0 +1,9 @@
+/*
+ * ht.h - idles hyperthreads on behalf of policies
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+extern int ht_idle(unsigned int core, uint64_t us);
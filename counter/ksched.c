@@ -9,6 +9,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <base/cpu.h>
 #include <base/log.h>
 
 #include "ksched.h"
@@ -25,6 +26,12 @@ int ksched_pmc_count;
 int last_intr_core;
 /* the shared memory region with the kernel module */
 struct ksched_shm_cpu *ksched_shm;
+/* the per-CPU sample rings filled by the kernel's sampling timers */
+struct ksched_ring *ksched_rings;
+/* the per-process counter table (NULL unless ksched was loaded with tasks=1) */
+struct ksched_task_tbl *ksched_tasks;
+/* the next unread sample in each ring */
+uint64_t ksched_ring_tails[NCPU];
 /* the set of pending cores to send interrupts to */
 cpu_set_t ksched_set;
 /* the generation number for each core */
@@ -69,9 +76,22 @@ int ksched_init(void)
 		    PROT_READ | PROT_WRITE, MAP_SHARED, ksched_fd, 0);
 	if (ksched_addr == MAP_FAILED)
 		return -errno;
+	ksched_shm = (struct ksched_shm_cpu *)ksched_addr;
+
+	/* then map the sample rings (one per CPU) */
+	ksched_addr = mmap(NULL, sizeof(struct ksched_ring) * cpu_count,
+		    PROT_READ, MAP_SHARED, ksched_fd, KSCHED_RING_OFFSET);
+	if (ksched_addr == MAP_FAILED)
+		return -errno;
+	ksched_rings = (struct ksched_ring *)ksched_addr;
+
+	/* then map the per-process table, if ksched keeps one */
+	ksched_addr = mmap(NULL, sizeof(struct ksched_task_tbl), PROT_READ,
+			   MAP_SHARED, ksched_fd, KSCHED_TASK_OFFSET);
+	if (ksched_addr != MAP_FAILED)
+		ksched_tasks = (struct ksched_task_tbl *)ksched_addr;
 
 	/* then initialize the generation numbers */
-	ksched_shm = (struct ksched_shm_cpu *)ksched_addr;
 	for (i = 0; i < NCPU; i++) {
 		ksched_gens[i] = load_acquire(&ksched_shm[i].last_gen);
 		// ksched_idle_hint(i, 0);
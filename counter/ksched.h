@@ -7,6 +7,7 @@
 #include <sched.h>
 #include <sys/ioctl.h>
 #include <signal.h>
+#include <string.h>
 
 #include <base/stddef.h>
 #include <base/atomic.h>
@@ -18,6 +19,9 @@
 extern int ksched_fd, ksched_count, ksched_pmc_count, last_intr_core;
 // extern bool ksched_has_uintr;
 extern struct ksched_shm_cpu *ksched_shm;
+extern struct ksched_ring *ksched_rings;
+extern struct ksched_task_tbl *ksched_tasks;
+extern uint64_t ksched_ring_tails[NCPU];
 extern cpu_set_t ksched_set;
 extern unsigned int ksched_gens[NCPU];
 
@@ -106,11 +110,21 @@ static inline void ksched_enqueue_intr(unsigned int core, int type)
 /**
  * ksched_enqueue_pmc - enqueues a performance counter request on a core
  * @core: the core to measure
- * @sel: the architecture-specific counter selector
+ * @sel: an array of architecture-specific counter selectors
+ * @nr: the number of selectors (at most KSCHED_NR_PMC)
+ *
+ * All of the counters in the group are programmed and read by the same
+ * interrupt, so their values cover the same window.
  */
-static inline void ksched_enqueue_pmc(unsigned int core, uint64_t sel)
+static inline void ksched_enqueue_pmc(unsigned int core, const uint64_t *sel,
+				      unsigned int nr)
 {
-	ksched_shm[core].pmcsel = sel;
+	unsigned int i;
+
+	assert(nr <= KSCHED_NR_PMC);
+	for (i = 0; i < nr; i++)
+		ksched_shm[core].pmcsel[i] = sel[i];
+	ksched_shm[core].pmcnr = nr;
 	store_release(&ksched_shm[core].pmc, 1);
 	CPU_SET(core, &ksched_set);
 	ksched_count++;
@@ -118,22 +132,131 @@ static inline void ksched_enqueue_pmc(unsigned int core, uint64_t sel)
 }
 
 /**
- * ksched_poll_pmc - polls for a performance counter result
+ * ksched_poll_pmc - polls for a group of performance counter results
  * @core: the core to poll
- * @val: a pointer to store the result
- * @tsc: a pointer to store the timestamp of the result
+ * @res: a pointer to store the counter snapshot
  *
  * Returns true if succesful, otherwise counter is still being measured.
  */
-static inline bool ksched_poll_pmc(unsigned int core, uint64_t *val, uint64_t *tsc)
+static inline bool ksched_poll_pmc(unsigned int core,
+				   struct ksched_pmc_sample *res)
 {
 	if (load_acquire(&ksched_shm[core].pmc) != 0)
 		return false;
-	*val = ACCESS_ONCE(ksched_shm[core].pmcval);
-	*tsc = ACCESS_ONCE(ksched_shm[core].pmctsc);
+	*res = ksched_shm[core].pmcres;
+	return true;
+}
+
+/**
+ * ksched_set_pmc - sets the counters sampled by a core's timer
+ * @core: the core to measure
+ * @sel: an array of architecture-specific counter selectors
+ * @nr: the number of selectors (at most KSCHED_NR_PMC)
+ *
+ * Unlike ksched_enqueue_pmc(), no interrupt is requested.
+ */
+static inline void ksched_set_pmc(unsigned int core, const uint64_t *sel,
+				  unsigned int nr)
+{
+	unsigned int i;
+
+	assert(nr <= KSCHED_NR_PMC);
+	for (i = 0; i < nr; i++)
+		ksched_shm[core].pmcsel[i] = sel[i];
+	store_release(&ksched_shm[core].pmcnr, nr);
+}
+
+/**
+ * ksched_poll_ring - drains a core's timer sample ring
+ * @core: the core to poll
+ * @res: a pointer to store the newest sample
+ *
+ * Returns true if a new sample was found, otherwise the timer has not fired
+ * since the last call.
+ */
+static inline bool ksched_poll_ring(unsigned int core,
+				    struct ksched_pmc_sample *res)
+{
+	struct ksched_ring *r = &ksched_rings[core];
+	uint64_t head;
+
+	do {
+		head = load_acquire(&r->head);
+		if (head == ksched_ring_tails[core])
+			return false;
+		*res = r->samples[(head - 1) & (KSCHED_RING_SIZE - 1)];
+		rmb();
+		/* retry if the kernel lapped the slot while we copied it */
+	} while (ACCESS_ONCE(r->head) - head >= KSCHED_RING_SIZE - 1);
+
+	ksched_ring_tails[core] = head;
 	return true;
 }
 
+/**
+ * ksched_arm_timers - starts or stops the per-CPU sampling timers
+ * @period_ns: the sampling period (or zero to stop the timers)
+ * @mask: the set of cores to sample
+ *
+ * Returns 0 if successful.
+ */
+static inline int ksched_arm_timers(uint64_t period_ns, cpu_set_t *mask)
+{
+	struct ksched_timer_req req;
+
+	req.period_ns = period_ns;
+	req.len = sizeof(*mask);
+	req.mask = mask;
+	return ioctl(ksched_fd, KSCHED_IOC_TIMER, &req);
+}
+
+/**
+ * ksched_setup_pmc - reserves a counter group for all later requests
+ * @sel: an array of architecture-specific counter selectors
+ * @nr: the number of selectors (at most KSCHED_NR_PMC)
+ *
+ * This is a no-op unless ksched was loaded with perf=1, in which case the
+ * counters are reserved through the kernel's perf_event subsystem and
+ * shared fairly with other PMU users.
+ *
+ * Returns 0 if successful.
+ */
+static inline int ksched_setup_pmc(const uint64_t *sel, unsigned int nr)
+{
+	struct ksched_pmc_setup_req req;
+	unsigned int i;
+
+	assert(nr <= KSCHED_NR_PMC);
+	memset(&req, 0, sizeof(req));
+	req.nr = nr;
+	for (i = 0; i < nr; i++)
+		req.sel[i] = sel[i];
+	return ioctl(ksched_fd, KSCHED_IOC_PMC_SETUP, &req);
+}
+
+/**
+ * ksched_sample_pmc - synchronously samples the counters on a set of cores
+ * @mask: the set of cores to sample
+ * @res: an array to store the results
+ * @nr: the capacity of @res
+ *
+ * The selectors last set with ksched_set_pmc() are used.
+ *
+ * Returns the number of results stored, or a negative error code.
+ */
+static inline int ksched_sample_pmc(cpu_set_t *mask,
+				    struct ksched_sample_res *res,
+				    unsigned int nr)
+{
+	struct ksched_sample_req req;
+
+	req.len = sizeof(*mask);
+	req.mask = mask;
+	req.nr = nr;
+	req.res = res;
+	return ioctl(ksched_fd, KSCHED_IOC_SAMPLE, &req);
+}
+
 /**
  * ksched_send_intrs - sends any pending interrupts
  */
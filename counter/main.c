@@ -1,28 +1,283 @@
+#include <signal.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <base/stddef.h>
-// #include <base/log.h>
+#include <base/init.h>
+#include <base/log.h>
 
+#include "defs.h"
+#include "sched.h"
+#include "sample.h"
+#include "publish.h"
+#include "policy.h"
+#include "resctrl.h"
+#include "mem_ctrl.h"
+#include "wait.h"
+
+struct counter_cfg cfg = {
+	.replay_speed	= 1,
+	.resctrl_root	= "/sys/fs/resctrl",
+};
+
+/* the signal that asked counterd to stop, or 0 */
+static volatile sig_atomic_t stop_signal;
+
+static void stop_handler(int signum)
+{
+	stop_signal = signum;
+}
+
+/*
+ * Exits through the main loop, so the atexit() handlers that hand back
+ * throttled cgroups and resctrl groups run, which they can't in a handler.
+ */
+static void install_stop_handlers(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+}
 
 void poll_loop(void) {
-	for (;;) {
-		sched_poll();
+	while (!stop_signal) {
+		wait_until(sched_poll());
 	}
+
+	log_info("main: caught signal %d, exiting", stop_signal);
+	init_shutdown(EXIT_SUCCESS);
 }
 
-void main(int argc, char *argv[]) {
-	int i, ret;
+static void print_usage(void)
+{
+	fprintf(stderr, "usage: counterd [norm tsc|ref|mperf] [timer <us>] "
+		"[sync] [backend ksched|perf]\n"
+		"\t[record <trace>] [replay <trace> [speed <x>]]\n"
+		"\t[publish memfd|sysv|none] [imc pcm|perf] [bwlimit <MB/s>]\n"
+		"\t[policy <lib.so> [args <string>]] [rdt [resctrl <dir>]]\n"
+		"\t[partition <MB/s>] [dryrun] [ht]\n"
+		"\t[interval <min us> <max us> [budget <percent>]] "
+		"[subsample <k>] [idleskip]\n"
+		"\t[wait spin|tpause|sleep]\n");
+	fprintf(stderr, "\tnorm: the cycle count used to normalize miss rates "
+		"(default tsc)\n");
+	fprintf(stderr, "\ttimer: sample with per-CPU kernel timers at this "
+		"period instead of IPIs\n");
+	fprintf(stderr, "\tsync: sample all cores with one synchronous ioctl "
+		"per window\n");
+	fprintf(stderr, "\tbackend: sample through the ksched module (default) "
+		"or perf_event_open()\n");
+	fprintf(stderr, "\trecord: write every gathered window to a trace\n");
+	fprintf(stderr, "\treplay: feed a recorded trace through the "
+		"estimators, speed times faster\n");
+	fprintf(stderr, "\tpublish: share the window ring as a memfd over a "
+		"unix socket (default), a System V segment, or not at all\n");
+	fprintf(stderr, "\timc: read memory controllers through PCM (default "
+		"when built with CONFIG_PCM) or the uncore_imc perf PMUs\n");
+	fprintf(stderr, "\tbwlimit: throttle the CPU quota of the heaviest "
+		"cgroups while DRAM bandwidth is above this\n");
+	fprintf(stderr, "\tpolicy: run a scheduling policy from a shared "
+		"object on every window, passing it args\n");
+	fprintf(stderr, "\trdt: monitor each cgroup's LLC occupancy and memory "
+		"bandwidth through resctrl (mounted at dir)\n");
+	fprintf(stderr, "\tpartition: give cgroups above this bandwidth fewer "
+		"LLC ways (CAT) and less memory bandwidth (MBA)\n");
+	fprintf(stderr, "\tdryrun: log what bwlimit, partition and policies "
+		"would change instead of changing it\n");
+	fprintf(stderr, "\tht: also report miss rates per physical core "
+		"(both hyperthreads)\n");
+	fprintf(stderr, "\tinterval: shorten the sampling window when bandwidth "
+		"or miss rates vary and lengthen it when stable, spending at "
+		"most budget (default 1%%) of CPU time on sampling\n");
+	fprintf(stderr, "\tsubsample: sample k cores (at least 2) of each LLC "
+		"in turn, plus hot ones, and extrapolate the rest\n");
+	fprintf(stderr, "\tidleskip: don't interrupt cores that were idle for "
+		"the whole window (ksched IPI and sync sampling)\n");
+	fprintf(stderr, "\twait: between windows, spin (default), tpause the "
+		"hyperthread, or sleep, leaving its sibling to tenants\n");
+}
 
-	if (getuid() != 0) {
+static int parse_norm(const char *arg)
+{
+	if (!strcmp(arg, "tsc"))
+		cfg.ias_norm = IAS_NORM_TSC;
+	else if (!strcmp(arg, "ref"))
+		cfg.ias_norm = IAS_NORM_REF_CYCLES;
+	else if (!strcmp(arg, "mperf"))
+		cfg.ias_norm = IAS_NORM_MPERF;
+	else
+		return -EINVAL;
+	return 0;
+}
+
+static int parse_wait(const char *arg)
+{
+	if (!strcmp(arg, "spin"))
+		cfg.wait = WAIT_SPIN;
+	else if (!strcmp(arg, "tpause"))
+		cfg.wait = WAIT_TPAUSE;
+	else if (!strcmp(arg, "sleep"))
+		cfg.wait = WAIT_SLEEP;
+	else
+		return -EINVAL;
+	return 0;
+}
+
+static int parse_publish(const char *arg)
+{
+	if (!strcmp(arg, "memfd"))
+		cfg.publish = PUBLISH_MEMFD;
+	else if (!strcmp(arg, "sysv"))
+		cfg.publish = PUBLISH_SYSV;
+	else if (!strcmp(arg, "none"))
+		cfg.publish = PUBLISH_NONE;
+	else
+		return -EINVAL;
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "norm") && i + 1 < argc) {
+			if (parse_norm(argv[++i])) {
+				print_usage();
+				return -EINVAL;
+			}
+		} else if (!strcmp(argv[i], "timer") && i + 1 < argc) {
+			cfg.ias_sample = IAS_SAMPLE_TIMER;
+			cfg.ias_timer_us = strtoull(argv[++i], NULL, 10);
+			if (!cfg.ias_timer_us) {
+				print_usage();
+				return -EINVAL;
+			}
+		} else if (!strcmp(argv[i], "sync")) {
+			cfg.ias_sample = IAS_SAMPLE_SYNC;
+		} else if (!strcmp(argv[i], "backend") && i + 1 < argc) {
+			i++;
+			if (!strcmp(argv[i], "ksched")) {
+				sample_ops = &ksched_sample_ops;
+			} else if (!strcmp(argv[i], "perf")) {
+				sample_ops = &perf_sample_ops;
+			} else {
+				print_usage();
+				return -EINVAL;
+			}
+		} else if (!strcmp(argv[i], "imc") && i + 1 < argc) {
+			i++;
+			if (!strcmp(argv[i], "perf")) {
+				mc_ops = &perf_mc_ops;
+#ifdef CONFIG_PCM
+			} else if (!strcmp(argv[i], "pcm")) {
+				mc_ops = &pcm_mc_ops;
+#endif
+			} else {
+				print_usage();
+				return -EINVAL;
+			}
+		} else if (!strcmp(argv[i], "publish") && i + 1 < argc) {
+			if (parse_publish(argv[++i])) {
+				print_usage();
+				return -EINVAL;
+			}
+		} else if (!strcmp(argv[i], "bwlimit") && i + 1 < argc) {
+			cfg.ias_bw_limit = strtof(argv[++i], NULL);
+			if (cfg.ias_bw_limit <= 0) {
+				print_usage();
+				return -EINVAL;
+			}
+		} else if (!strcmp(argv[i], "policy") && i + 1 < argc) {
+			cfg.policy_path = argv[++i];
+		} else if (!strcmp(argv[i], "args") && i + 1 < argc) {
+			cfg.policy_args = argv[++i];
+		} else if (!strcmp(argv[i], "rdt")) {
+			cfg.rdt = true;
+		} else if (!strcmp(argv[i], "resctrl") && i + 1 < argc) {
+			cfg.resctrl_root = argv[++i];
+		} else if (!strcmp(argv[i], "partition") && i + 1 < argc) {
+			cfg.rdt = true;
+			cfg.rdt_partition_mbps = strtof(argv[++i], NULL);
+			if (cfg.rdt_partition_mbps <= 0) {
+				print_usage();
+				return -EINVAL;
+			}
+		} else if (!strcmp(argv[i], "dryrun")) {
+			cfg.dry_run = true;
+		} else if (!strcmp(argv[i], "ht")) {
+			cfg.ias_ht = true;
+		} else if (!strcmp(argv[i], "interval") && i + 2 < argc) {
+			cfg.ias_interval_min_us = strtoull(argv[++i], NULL, 10);
+			cfg.ias_interval_max_us = strtoull(argv[++i], NULL, 10);
+			if (!cfg.ias_interval_min_us ||
+			    cfg.ias_interval_min_us > cfg.ias_interval_max_us) {
+				print_usage();
+				return -EINVAL;
+			}
+		} else if (!strcmp(argv[i], "subsample") && i + 1 < argc) {
+			cfg.ias_subsample = strtoul(argv[++i], NULL, 10);
+			if (cfg.ias_subsample < 2) {
+				print_usage();
+				return -EINVAL;
+			}
+		} else if (!strcmp(argv[i], "idleskip")) {
+			cfg.ias_idle_skip = true;
+		} else if (!strcmp(argv[i], "wait") && i + 1 < argc) {
+			if (parse_wait(argv[++i])) {
+				print_usage();
+				return -EINVAL;
+			}
+		} else if (!strcmp(argv[i], "budget") && i + 1 < argc) {
+			cfg.ias_overhead_budget = strtof(argv[++i], NULL) / 100;
+			if (cfg.ias_overhead_budget <= 0 ||
+			    cfg.ias_overhead_budget > 1) {
+				print_usage();
+				return -EINVAL;
+			}
+		} else if (!strcmp(argv[i], "record") && i + 1 < argc) {
+			cfg.record_path = argv[++i];
+		} else if (!strcmp(argv[i], "replay") && i + 1 < argc) {
+			cfg.replay_path = argv[++i];
+			sample_ops = &replay_sample_ops;
+		} else if (!strcmp(argv[i], "speed") && i + 1 < argc) {
+			cfg.replay_speed = strtoul(argv[++i], NULL, 10);
+			if (!cfg.replay_speed) {
+				print_usage();
+				return -EINVAL;
+			}
+		} else {
+			print_usage();
+			return -EINVAL;
+		}
+	}
+
+	/* replaying a trace touches no hardware */
+	if (!cfg.replay_path && getuid() != 0) {
 		fprintf(stderr, "Error: please run as root\n");
 		return -EPERM;
 	}
 
 	base_init();
-	ksched_init();
+	install_stop_handlers();
+	wait_init();
 	sched_init();
-	ias_bw_init();
+	if (ias_bw_init())
+		init_shutdown(EXIT_FAILURE);
+	if (rdt_init())
+		return -ENODEV;
+	if (policy_init())
+		return -EINVAL;
+	/* without the ring, results are still logged */
+	publish_init();
 
 	poll_loop();
-}
\ No newline at end of file
+	return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * mem_ctrl.c - DRAM bandwidth from the memory controllers' CAS counters
+ *
+ * Every window, the read and write CAS counts of each active channel on
+ * every socket are sampled from a source: the kernel's uncore_imc perf PMUs,
+ * the patched PCM library (with CONFIG_PCM), or a trace when replaying. Each
+ * CAS command moves one cache line.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+
+#include "defs.h"
+#include "sched.h"
+#include "sample.h"
+#include "pcm.h"
+#include "mem_ctrl.h"
+
+/* the uncore CAS counters are 48 bits wide */
+#define MC_CTR_MASK		((1UL << 48) - 1)
+/* how long to watch the counters to find the active channels */
+#define MC_PROBE_US		10000
+
+struct mc_socket mc_sockets[NNUMA];
+unsigned int mc_nr_sockets;
+unsigned int mc_nr_channels;
+
+static uint64_t mc_last_tsc;
+
+#ifdef CONFIG_PCM
+const struct mc_ops *mc_ops = &pcm_mc_ops;
+#else
+const struct mc_ops *mc_ops = &perf_mc_ops;
+#endif
+
+#ifdef CONFIG_PCM
+static int pcm_mc_init(void)
+{
+	unsigned int s, nr;
+	int ret;
+
+	/* ensure threads created by pcm are pinned to control core */
+	pin_thread(0, sched_ctrl_core);
+
+	/* PCM is only set up by the first init, so it can't be queried before */
+	ret = pcm_caladan_init(0);
+	if (ret)
+		return ret;
+
+	nr = pcm_caladan_get_socket_count();
+	mc_nr_sockets = MIN(nr, NNUMA);
+	for (s = 1; s < mc_nr_sockets; s++) {
+		ret = pcm_caladan_init(s);
+		if (ret)
+			return ret;
+	}
+	nr = pcm_caladan_get_channel_count();
+	mc_nr_channels = MIN(nr, MC_MAX_CHANNELS);
+	return 0;
+}
+
+static uint64_t pcm_mc_read(unsigned int socket, unsigned int channel,
+			    bool write)
+{
+	return pcm_caladan_get_cas(socket, channel, write);
+}
+
+const struct mc_ops pcm_mc_ops = {
+	.name	= "pcm",
+	.init	= pcm_mc_init,
+	.read	= pcm_mc_read,
+};
+#endif
+
+static int replay_mc_init(void)
+{
+	mc_nr_sockets = replay_nr_sockets;
+	mc_nr_channels = replay_nr_channels;
+	return 0;
+}
+
+static const struct mc_ops replay_mc_ops = {
+	.name	= "replay",
+	.init	= replay_mc_init,
+	.read	= replay_get_cas,
+};
+
+/**
+ * mc_poll - samples every active channel and updates the per-socket rates
+ *
+ * Call once per window. The first call only establishes a baseline.
+ */
+void mc_poll(void)
+{
+	struct mc_socket *sock;
+	uint64_t tsc, rd, wr, rd_sum, wr_sum;
+	unsigned int s, i, ch;
+
+	if (mc_ops == &replay_mc_ops) {
+		tsc = replay_window_tsc;
+	} else {
+		barrier();
+		tsc = rdtsc();
+		barrier();
+	}
+
+	for (s = 0; s < mc_nr_sockets; s++) {
+		sock = &mc_sockets[s];
+		rd_sum = wr_sum = 0;
+
+		for (i = 0; i < sock->nr_channels; i++) {
+			ch = sock->channels[i];
+			rd = mc_ops->read(s, ch, false);
+			wr = mc_ops->read(s, ch, true);
+			record_cas(s, ch, rd, wr);
+
+			rd_sum += (rd - sock->last_rd[i]) & MC_CTR_MASK;
+			wr_sum += (wr - sock->last_wr[i]) & MC_CTR_MASK;
+			sock->last_rd[i] = rd;
+			sock->last_wr[i] = wr;
+		}
+
+		if (mc_last_tsc && tsc > mc_last_tsc) {
+			sock->rd_rate = (float)rd_sum / (float)(tsc - mc_last_tsc);
+			sock->wr_rate = (float)wr_sum / (float)(tsc - mc_last_tsc);
+		}
+	}
+
+	mc_last_tsc = tsc;
+}
+
+/* keeps the channels whose counters move while we watch */
+static void mc_probe_channels(void)
+{
+	uint64_t start[NNUMA][MC_MAX_CHANNELS];
+	struct mc_socket *sock;
+	unsigned int s, ch;
+
+	for (s = 0; s < mc_nr_sockets; s++) {
+		for (ch = 0; ch < mc_nr_channels; ch++)
+			start[s][ch] = mc_ops->read(s, ch, false) +
+				       mc_ops->read(s, ch, true);
+	}
+
+	usleep(MC_PROBE_US);
+
+	for (s = 0; s < mc_nr_sockets; s++) {
+		sock = &mc_sockets[s];
+		for (ch = 0; ch < mc_nr_channels; ch++) {
+			if (mc_ops->read(s, ch, false) +
+			    mc_ops->read(s, ch, true) == start[s][ch])
+				continue;
+			sock->channels[sock->nr_channels++] = ch;
+		}
+	}
+}
+
+/**
+ * mc_init - programs the memory controllers of every socket
+ *
+ * Returns 0 if successful.
+ */
+int mc_init(void)
+{
+	unsigned int s, ch, nr_active = 0;
+	int ret;
+
+	if (sample_ops == &replay_sample_ops)
+		mc_ops = &replay_mc_ops;
+
+	ret = mc_ops->init();
+	if (ret) {
+		log_err("mc: could not init the %s source (%s)", mc_ops->name,
+			strerror(-ret));
+		return ret;
+	}
+
+	if (mc_ops == &replay_mc_ops) {
+		/* channels missing from the trace simply never move */
+		for (s = 0; s < mc_nr_sockets; s++) {
+			for (ch = 0; ch < mc_nr_channels; ch++)
+				mc_sockets[s].channels[ch] = ch;
+			mc_sockets[s].nr_channels = mc_nr_channels;
+		}
+		return 0;
+	}
+
+	mc_probe_channels();
+	for (s = 0; s < mc_nr_sockets; s++) {
+		log_info("mc: socket %d has %d active memory channels (%s)", s,
+			 mc_sockets[s].nr_channels, mc_ops->name);
+		nr_active += mc_sockets[s].nr_channels;
+	}
+
+	return nr_active ? 0 : -EINVAL;
+}
@@ -0,0 +1,58 @@
+/*
+ * mem_ctrl.h - DRAM bandwidth from the memory controllers' CAS counters
+ */
+
+#pragma once
+
+#include <base/stddef.h>
+#include <base/limits.h>
+
+/* the most memory channels per socket that are sampled */
+#define MC_MAX_CHANNELS		16
+
+struct mc_socket {
+	unsigned int	nr_channels;	/* active channels */
+	unsigned int	channels[MC_MAX_CHANNELS];
+	uint64_t	last_rd[MC_MAX_CHANNELS];
+	uint64_t	last_wr[MC_MAX_CHANNELS];
+
+	/* CAS commands per TSC cycle over the last window */
+	float		rd_rate;
+	float		wr_rate;
+};
+
+/*
+ * A source reads the cumulative CAS counts of memory channels.
+ */
+struct mc_ops {
+	const char	*name;
+
+	/**
+	 * init - prepares to read every channel
+	 *
+	 * Sets mc_nr_sockets and mc_nr_channels. Returns 0 if successful.
+	 */
+	int (*init)(void);
+
+	/**
+	 * read - reads a channel's cumulative CAS count
+	 * @socket: the socket of the memory controller
+	 * @channel: the channel on the socket
+	 * @write: read the write CAS count instead of the read one
+	 */
+	uint64_t (*read)(unsigned int socket, unsigned int channel, bool write);
+};
+
+extern const struct mc_ops *mc_ops;
+#ifdef CONFIG_PCM
+extern const struct mc_ops pcm_mc_ops;
+#endif
+extern const struct mc_ops perf_mc_ops;
+
+extern struct mc_socket mc_sockets[NNUMA];
+extern unsigned int mc_nr_sockets;
+/* channels per socket, whether active or not */
+extern unsigned int mc_nr_channels;
+
+extern int mc_init(void);
+extern void mc_poll(void);
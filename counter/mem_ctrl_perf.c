@@ -0,0 +1,250 @@
+/*
+ * mem_ctrl_perf.c - reads CAS counts through the kernel's uncore_imc PMUs
+ *
+ * Each uncore_imc_<n> PMU is one memory channel on every socket; its cpumask
+ * names one CPU per socket to open the channel's counters on. The CAS events
+ * are encoded from the PMU's own sysfs event aliases, so the same code works
+ * across server generations without PCM.
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <base/stddef.h>
+#include <base/bitmap.h>
+#include <base/cpu.h>
+#include <base/log.h>
+#include <base/sysfs.h>
+
+#include "defs.h"
+#include "mem_ctrl.h"
+
+#define PERF_PMU_PATH		"/sys/bus/event_source/devices"
+#define PERF_IMC_PREFIX		"uncore_imc_"
+
+/* counter fds per socket, channel and direction (read, write) */
+static int imc_fds[NNUMA][MC_MAX_CHANNELS][2];
+/* the last value read from each, returned again if a read fails */
+static uint64_t imc_last[NNUMA][MC_MAX_CHANNELS][2];
+
+/* true for uncore_imc_<n> PMUs that have the CAS event aliases */
+static bool imc_is_channel(const char *name)
+{
+	const char *p = name + strlen(PERF_IMC_PREFIX);
+	char path[PATH_MAX];
+
+	/* not uncore_imc_free_running_<n>, which counts differently */
+	if (strncmp(name, PERF_IMC_PREFIX, strlen(PERF_IMC_PREFIX)) || !*p)
+		return false;
+	for (; *p; p++) {
+		if (!isdigit(*p))
+			return false;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s/events/cas_count_read",
+		 PERF_PMU_PATH, name);
+	if (access(path, R_OK))
+		return false;
+	snprintf(path, sizeof(path), "%s/%s/events/cas_count_write",
+		 PERF_PMU_PATH, name);
+	return !access(path, R_OK);
+}
+
+/* the PMU directory names, sorted so channel numbers are stable */
+static int imc_name_cmp(const void *a, const void *b)
+{
+	const char *x = *(const char **)a + strlen(PERF_IMC_PREFIX);
+	const char *y = *(const char **)b + strlen(PERF_IMC_PREFIX);
+
+	return atoi(x) - atoi(y);
+}
+
+/* sets a format field (e.g. "config:8-15") in an event's config */
+static int imc_apply_format(const char *pmu, const char *term, uint64_t val,
+			    uint64_t *config)
+{
+	char path[PATH_MAX], buf[64];
+	unsigned int lo, hi;
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s/format/%s", PERF_PMU_PATH, pmu,
+		 term);
+	f = fopen(path, "r");
+	if (!f)
+		return -ENOENT;
+	ret = fgets(buf, sizeof(buf), f) ? 0 : -EIO;
+	fclose(f);
+	if (ret)
+		return ret;
+
+	ret = sscanf(buf, "config:%u-%u", &lo, &hi);
+	if (ret == 1)
+		hi = lo;
+	else if (ret != 2 || hi < lo || hi > 63)
+		return -EINVAL;
+
+	*config |= (val << lo) & (~0UL >> (63 - hi));
+	return 0;
+}
+
+/* encodes a sysfs event alias (e.g. "event=0x04,umask=0x03") */
+static int imc_parse_event(const char *pmu, const char *event,
+			   uint64_t *config)
+{
+	char path[PATH_MAX], buf[256], *term, *val, *saveptr;
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s/events/%s", PERF_PMU_PATH, pmu,
+		 event);
+	f = fopen(path, "r");
+	if (!f)
+		return -ENOENT;
+	ret = fgets(buf, sizeof(buf), f) ? 0 : -EIO;
+	fclose(f);
+	if (ret)
+		return ret;
+
+	*config = 0;
+	for (term = strtok_r(buf, ",\n", &saveptr); term;
+	     term = strtok_r(NULL, ",\n", &saveptr)) {
+		val = strchr(term, '=');
+		if (val)
+			*val++ = '\0';
+		ret = imc_apply_format(pmu, term, val ? strtoull(val, NULL, 0) : 1,
+				       config);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int imc_open(uint32_t type, uint64_t config, int cpu)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+
+	return syscall(__NR_perf_event_open, &attr, -1, cpu, -1,
+		       PERF_FLAG_FD_CLOEXEC);
+}
+
+/* opens one channel's counters on every socket */
+static int imc_open_channel(const char *pmu, unsigned int channel)
+{
+	DEFINE_BITMAP(cpus, NCPU);
+	char path[PATH_MAX];
+	uint64_t type, rd, wr;
+	int cpu, socket, ret;
+
+	snprintf(path, sizeof(path), "%s/%s/type", PERF_PMU_PATH, pmu);
+	ret = sysfs_parse_val(path, &type);
+	if (ret)
+		return ret;
+	ret = imc_parse_event(pmu, "cas_count_read", &rd);
+	if (ret)
+		return ret;
+	ret = imc_parse_event(pmu, "cas_count_write", &wr);
+	if (ret)
+		return ret;
+
+	snprintf(path, sizeof(path), "%s/%s/cpumask", PERF_PMU_PATH, pmu);
+	ret = sysfs_parse_bitlist(path, cpus, NCPU);
+	if (ret)
+		return ret;
+
+	bitmap_for_each_set(cpus, NCPU, cpu) {
+		socket = cpu_info_tbl[cpu].package;
+		if (socket >= NNUMA)
+			continue;
+
+		imc_fds[socket][channel][0] = imc_open(type, rd, cpu);
+		imc_fds[socket][channel][1] = imc_open(type, wr, cpu);
+		if (imc_fds[socket][channel][0] < 0 ||
+		    imc_fds[socket][channel][1] < 0)
+			return -errno;
+		mc_nr_sockets = MAX(mc_nr_sockets, socket + 1);
+	}
+
+	return 0;
+}
+
+static int perf_mc_init(void)
+{
+	char **names = NULL, **tmp;
+	unsigned int i, nr = 0;
+	struct dirent *ent;
+	DIR *dir;
+	int ret = 0;
+
+	memset(imc_fds, -1, sizeof(imc_fds));
+
+	dir = opendir(PERF_PMU_PATH);
+	if (!dir)
+		return -errno;
+	while ((ent = readdir(dir)) != NULL) {
+		if (!imc_is_channel(ent->d_name))
+			continue;
+		tmp = realloc(names, (nr + 1) * sizeof(*names));
+		if (!tmp) {
+			ret = -ENOMEM;
+			break;
+		}
+		names = tmp;
+		names[nr++] = strdup(ent->d_name);
+	}
+	closedir(dir);
+
+	if (!ret && nr == 0) {
+		log_err("mc: no %s<n> PMUs (is the uncore driver loaded?)",
+			PERF_IMC_PREFIX);
+		ret = -ENODEV;
+	}
+
+	/* sort first, so the channels kept are always the lowest numbered */
+	qsort(names, nr, sizeof(*names), imc_name_cmp);
+	if (!ret && nr > MC_MAX_CHANNELS)
+		log_warn("mc: only reading %d of %u channels", MC_MAX_CHANNELS,
+			 nr);
+
+	for (i = 0; i < nr; i++) {
+		if (!ret && i < MC_MAX_CHANNELS)
+			ret = imc_open_channel(names[i], i);
+		free(names[i]);
+	}
+	free(names);
+
+	mc_nr_channels = MIN(nr, MC_MAX_CHANNELS);
+	return ret;
+}
+
+static uint64_t perf_mc_read(unsigned int socket, unsigned int channel,
+			     bool write)
+{
+	uint64_t *last = &imc_last[socket][channel][write];
+	uint64_t val;
+
+	/* a zero delta rather than one from 0 */
+	if (read(imc_fds[socket][channel][write], &val, sizeof(val)) !=
+	    sizeof(val))
+		return *last;
+	*last = val;
+	return val;
+}
+
+const struct mc_ops perf_mc_ops = {
+	.name	= "perf",
+	.init	= perf_mc_init,
+	.read	= perf_mc_read,
+};
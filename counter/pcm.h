@@ -4,5 +4,9 @@
 
 /* Declarations of relevant functions in patched PCM library */
 extern uint32_t pcm_caladan_get_cas_count(uint32_t channel);
+extern uint64_t pcm_caladan_get_cas(uint32_t socket, uint32_t channel,
+				    int write);
+extern uint32_t pcm_caladan_get_socket_count(void);
+extern uint32_t pcm_caladan_get_channel_count(void);
 extern uint32_t pcm_caladan_get_active_channel_count(void);
-extern int pcm_caladan_init(int socket);
\ No newline at end of file
+extern int pcm_caladan_init(int socket);
@@ -33,3 +33,7 @@
 			PMC_ESEL_ENABLE)
 #define PMC_LLC_MISSES_ANY (PMC_ARCH_LLC_MISSES | PMC_ESEL_USR | PMC_ESEL_OS | \
 			    PMC_ESEL_ANY | PMC_ESEL_ENABLE)
+
+/* LLC references, sampled with PMC_LLC_MISSES to derive a miss ratio */
+#define PMC_LLC_REF (PMC_ARCH_LLC_REF | PMC_ESEL_USR | PMC_ESEL_OS | \
+		     PMC_ESEL_ENABLE)
@@ -0,0 +1,230 @@
+/*
+ * policy.c - loads a scheduling policy and runs it on every window
+ *
+ * The policy is a shared object implementing inc/counter/policy.h. Its
+ * actions go through the same helpers counterd uses itself; when replaying a
+ * trace (or in a dry run), they are logged instead of applied, so policies
+ * can be compared on the same recorded windows.
+ */
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+
+#include "defs.h"
+#include "sched.h"
+#include "cgroup.h"
+#include "policy.h"
+#include "resctrl.h"
+#include "ht.h"
+#include "estimate.h"
+
+/* the loaded scheduling policy, or NULL */
+const struct counter_policy *sched_policy;
+
+struct policy_cores policy_cores;
+struct policy_sockets policy_sockets;
+
+static struct counter_policy_window policy_win = {
+	.core		= policy_cores.core,
+	.socket		= policy_cores.socket,
+	.tgid		= policy_cores.tgid,
+	.llc_misses	= est_win.misses,
+	.llc_refs	= est_win.refs,
+	.instrs		= est_win.instrs,
+	.cycles		= est_win.cycles,
+	.miss_rate	= est_win.miss_rate,
+	.busy		= est_win.busy,
+	.mpki		= est_win.mpki,
+	.ipc		= est_win.ipc,
+	.sibling	= policy_cores.sibling,
+	.sampled	= est_win.sampled,
+	.bw_rd_mbps	= policy_sockets.bw_rd_mbps,
+	.bw_wr_mbps	= policy_sockets.bw_wr_mbps,
+	.bw_mbps	= policy_sockets.bw_mbps,
+	.llc_mbps	= policy_sockets.llc_mbps,
+	.llc_mbps_ci	= policy_sockets.llc_mbps_ci,
+};
+
+/* true if @tid is the main thread of its process (so its tgid) */
+static bool policy_is_tgid(pid_t tid)
+{
+	char path[64], line[128];
+	bool ret = false;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", tid);
+	f = fopen(path, "r");
+	if (!f)
+		return false;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "Tgid:", 5)) {
+			ret = atoi(line + 5) == tid;
+			break;
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+/* pins every thread of a process, returns the first error */
+static int policy_pin_process(pid_t tgid, unsigned int core)
+{
+	struct dirent *ent;
+	char path[64];
+	int ret = 0, err;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", tgid);
+	d = opendir(path);
+	if (!d)
+		return -errno;
+	while ((ent = readdir(d))) {
+		if (ent->d_name[0] == '.')
+			continue;
+		err = pin_thread(atoi(ent->d_name), core);
+		/* threads may exit while the list is walked */
+		if (err && err != -ESRCH && !ret)
+			ret = err;
+	}
+	closedir(d);
+	return ret;
+}
+
+static int policy_pin(pid_t tid, unsigned int core)
+{
+	if (core >= NCPU)
+		return -EINVAL;
+	if (cfg.replay_path || cfg.dry_run) {
+		log_info("policy: would pin %d to core %u", tid, core);
+		return 0;
+	}
+	if (policy_is_tgid(tid))
+		return policy_pin_process(tid, core);
+	return pin_thread(tid, core);
+}
+
+static int policy_throttle(const char *cgroup, uint64_t quota_us,
+			   uint64_t period_us)
+{
+	char buf[64];
+
+	if (cfg.replay_path) {
+		log_info("policy: would limit cgroup %s to %" PRIu64 "/%" PRIu64
+			 " us", cgroup, quota_us, period_us);
+		return 0;
+	}
+	snprintf(buf, sizeof(buf), "%" PRIu64 " %" PRIu64, quota_us, period_us);
+	return cg_write_max(cgroup, buf);
+}
+
+static int policy_unthrottle(const char *cgroup)
+{
+	if (cfg.replay_path) {
+		log_info("policy: would lift the limit of cgroup %s", cgroup);
+		return 0;
+	}
+	return cg_write_max(cgroup, "max");
+}
+
+static int policy_resctrl(const char *group, unsigned int socket,
+			  uint64_t l3_mask, unsigned int mba_percent)
+{
+	if (cfg.replay_path) {
+		log_info("policy: would set resctrl group %s on socket %u to "
+			 "L3 %" PRIx64 ", MB %u%%", group, socket, l3_mask,
+			 mba_percent);
+		return 0;
+	}
+	return rdt_set_schemata(group, socket, l3_mask, mba_percent);
+}
+
+static const struct counter_policy_actions policy_actions = {
+	.pin		= policy_pin,
+	.throttle	= policy_throttle,
+	.unthrottle	= policy_unthrottle,
+	.resctrl	= policy_resctrl,
+	.idle		= ht_idle,
+};
+
+/**
+ * policy_window - hands the window in policy_cores and policy_sockets to the
+ * policy
+ * @nr_cores: the number of cores filled in
+ * @nr_sockets: the number of sockets filled in
+ */
+void policy_window(unsigned int nr_cores, unsigned int nr_sockets)
+{
+	policy_win.now_us = now_us;
+	policy_win.nr_cores = nr_cores;
+	policy_win.nr_sockets = nr_sockets;
+	sched_policy->window(&policy_win);
+}
+
+static void policy_exit(void)
+{
+	sched_policy->exit();
+}
+
+/**
+ * policy_init - loads the policy given by cfg.policy_path, if any
+ *
+ * Returns 0 if successful.
+ */
+int policy_init(void)
+{
+	const struct counter_policy *p;
+	void *handle;
+	int ret;
+
+	if (!cfg.policy_path)
+		return 0;
+
+	handle = dlopen(cfg.policy_path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		log_err("policy: could not load %s (%s)", cfg.policy_path,
+			dlerror());
+		return -EINVAL;
+	}
+
+	p = dlsym(handle, COUNTER_POLICY_SYM);
+	if (!p) {
+		log_err("policy: %s has no '%s' symbol", cfg.policy_path,
+			COUNTER_POLICY_SYM);
+		goto fail;
+	}
+	if (p->abi != COUNTER_POLICY_ABI) {
+		log_err("policy: %s was built for ABI %u, not %u",
+			cfg.policy_path, p->abi, COUNTER_POLICY_ABI);
+		goto fail;
+	}
+	if (!p->window) {
+		log_err("policy: %s has no window callback", cfg.policy_path);
+		goto fail;
+	}
+
+	if (p->init) {
+		ret = p->init(&policy_actions, cfg.policy_args);
+		if (ret) {
+			log_err("policy: %s failed to init (%s)", p->name,
+				strerror(-ret));
+			goto fail;
+		}
+	}
+
+	sched_policy = p;
+	if (p->exit)
+		atexit(policy_exit);
+	log_info("policy: running %s", p->name);
+	return 0;
+
+fail:
+	dlclose(handle);
+	return -EINVAL;
+}
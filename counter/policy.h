@@ -0,0 +1,35 @@
+/*
+ * policy.h - runs a loadable scheduling policy on every window
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <base/limits.h>
+#include <counter/policy.h>
+
+/*
+ * the rest of a window's per-core statistics (the counters and rates come
+ * straight from est_win), filled in by the bandwidth poller
+ */
+struct policy_cores {
+	uint32_t	core[NCPU];
+	uint32_t	socket[NCPU];
+	uint32_t	tgid[NCPU];
+	int32_t		sibling[NCPU];
+};
+
+struct policy_sockets {
+	float		bw_rd_mbps[NNUMA];
+	float		bw_wr_mbps[NNUMA];
+	float		bw_mbps[NNUMA];
+	float		llc_mbps[NNUMA];
+	float		llc_mbps_ci[NNUMA];
+};
+
+extern struct policy_cores policy_cores;
+extern struct policy_sockets policy_sockets;
+
+extern int policy_init(void);
+extern void policy_window(unsigned int nr_cores, unsigned int nr_sockets);
@@ -0,0 +1,283 @@
+/*
+ * publish.c - publishes each sampling window into a shared memory ring
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/mem.h>
+#include <counter/shm.h>
+
+#include "defs.h"
+#include "sched.h"
+#include "publish.h"
+
+#ifndef MFD_HUGE_2MB
+#define MFD_HUGE_2MB		(21U << 26)
+#endif
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE	0x0010
+#endif
+
+/* the control thread waits twice as long after each failed accept() (us) */
+#define PUBLISH_ACCEPT_MIN_DELAY_US	1000
+#define PUBLISH_ACCEPT_MAX_DELAY_US	1000000
+
+static struct counter_shm *shm;
+static size_t shm_len;
+static int shm_fd = -1;
+
+/**
+ * publish_begin - claims the ring slot for the next window
+ *
+ * Returns the slot to fill, or NULL if publishing is disabled.
+ */
+struct counter_shm_window *publish_begin(void)
+{
+	struct counter_shm_window *w;
+
+	if (!shm)
+		return NULL;
+
+	w = counter_shm_window(shm, shm->seq + 1);
+	store_release(&w->seq, 0);
+	wmb();
+	return w;
+}
+
+/**
+ * publish_end - makes a window filled after publish_begin() visible
+ * @w: the slot returned by publish_begin()
+ */
+void publish_end(struct counter_shm_window *w)
+{
+	uint64_t seq = shm->seq + 1;
+
+	store_release(&w->seq, seq);
+	store_release(&shm->seq, seq);
+}
+
+static void *publish_map_sysv(void)
+{
+	void *addr;
+
+	addr = mem_map_shm(COUNTER_SHM_KEY, NULL, shm_len, PGSIZE_2MB, false);
+	if (addr == MAP_FAILED) {
+		log_warn("publish: no huge pages, using 4KB pages for the ring");
+		addr = mem_map_shm(COUNTER_SHM_KEY, NULL, shm_len, PGSIZE_4KB,
+				   false);
+	}
+	if (addr == MAP_FAILED)
+		log_err("publish: could not map the ring (%s)", strerror(errno));
+
+	return addr;
+}
+
+static void *publish_map_fd(unsigned int flags)
+{
+	void *addr;
+
+	shm_fd = memfd_create("counterd", MFD_CLOEXEC | MFD_ALLOW_SEALING | flags);
+	if (shm_fd < 0)
+		return MAP_FAILED;
+
+	/* hugetlb memfds only fail at mmap() time when no pages are free */
+	if (ftruncate(shm_fd, shm_len))
+		goto fail;
+	addr = mmap(NULL, shm_len, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	if (addr == MAP_FAILED)
+		goto fail;
+
+	/*
+	 * Our mapping stays writable, but no mapping made from the fd after
+	 * this can be, so clients can be handed the fd itself.
+	 */
+	if (fcntl(shm_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+		  F_SEAL_FUTURE_WRITE | F_SEAL_SEAL)) {
+		munmap(addr, shm_len);
+		goto fail;
+	}
+
+	return addr;
+
+fail:
+	close(shm_fd);
+	shm_fd = -1;
+	return MAP_FAILED;
+}
+
+static void *publish_map_memfd(void)
+{
+	void *addr;
+
+	addr = publish_map_fd(MFD_HUGETLB | MFD_HUGE_2MB);
+	if (addr == MAP_FAILED) {
+		log_warn("publish: no huge pages, using 4KB pages for the ring");
+		addr = publish_map_fd(0);
+	}
+	if (addr == MAP_FAILED)
+		log_err("publish: could not create a sealed memfd (%s)",
+			strerror(errno));
+
+	return addr;
+}
+
+static int publish_send_fd(int conn)
+{
+	char buf[CMSG_SPACE(sizeof(int))];
+	uint64_t len = shm_len;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(buf, 0, sizeof(buf));
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = buf;
+	msg.msg_controllen = sizeof(buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &shm_fd, sizeof(int));
+
+	if (sendmsg(conn, &msg, MSG_NOSIGNAL) != sizeof(len))
+		return -errno;
+	return 0;
+}
+
+/* hands the ring to every client that connects, off the polling core */
+static void *publish_control_thread(void *arg)
+{
+	int sock = (long)arg, conn;
+	unsigned int delay_us = 0;
+
+	/* keep to counterd's core, so it never lands on one a policy idles */
+	pin_thread(0, sched_ctrl_core);
+
+	while (true) {
+		conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EMFILE && errno != ENFILE &&
+			    errno != ENOBUFS && errno != ENOMEM)
+				break;
+
+			/* out of descriptors or memory, wait for some */
+			if (!delay_us)
+				log_err("publish: accept() failed (%s), "
+					"retrying", strerror(errno));
+			delay_us = MIN(MAX(delay_us * 2,
+					   PUBLISH_ACCEPT_MIN_DELAY_US),
+				       PUBLISH_ACCEPT_MAX_DELAY_US);
+			usleep(delay_us);
+			continue;
+		}
+		delay_us = 0;
+
+		if (publish_send_fd(conn))
+			log_warn("publish: could not hand out the ring");
+		close(conn);
+	}
+
+	log_err("publish: accept() failed (%s), no longer handing out the "
+		"ring", strerror(errno));
+	close(sock);
+	return NULL;
+}
+
+static int publish_serve(void)
+{
+	struct sockaddr_un addr;
+	pthread_t tid;
+	int sock, ret;
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, COUNTER_SOCK_PATH, sizeof(COUNTER_SOCK_PATH) - 1);
+	if (bind(sock, (struct sockaddr *)&addr,
+		 offsetof(struct sockaddr_un, sun_path) +
+		 sizeof(COUNTER_SOCK_PATH) - 1) || listen(sock, 16)) {
+		ret = -errno;
+		log_err("publish: could not listen on the control socket (%s)",
+			strerror(errno));
+		close(sock);
+		return ret;
+	}
+
+	ret = -pthread_create(&tid, NULL, publish_control_thread,
+			      (void *)(long)sock);
+	if (ret) {
+		close(sock);
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * publish_init - creates the shared memory ring
+ *
+ * By default the ring is a sealed memfd handed to clients over
+ * COUNTER_SOCK_PATH; 'publish sysv' maps it at COUNTER_SHM_KEY instead.
+ * Huge pages are preferred, but the ring falls back to small pages when none
+ * are reserved. Returns 0 if successful.
+ */
+int publish_init(void)
+{
+	void *addr;
+	int ret;
+
+	if (cfg.publish == PUBLISH_NONE)
+		return 0;
+
+	shm_len = COUNTER_SHM_SIZE;
+	if (cfg.publish == PUBLISH_SYSV)
+		addr = publish_map_sysv();
+	else
+		addr = publish_map_memfd();
+	if (addr == MAP_FAILED)
+		return -errno;
+
+	/* a segment left by an earlier run starts over */
+	shm = addr;
+	store_release(&shm->magic, 0);
+	memset(shm, 0, sizeof(*shm));
+	shm->version = COUNTER_SHM_VERSION;
+	shm->ring_size = COUNTER_SHM_RING_SIZE;
+	shm->window_size = sizeof(struct counter_shm_window);
+	shm->cycles_per_us = cycles_per_us;
+	store_release(&shm->magic, COUNTER_SHM_MAGIC);
+
+	if (cfg.publish == PUBLISH_MEMFD) {
+		ret = publish_serve();
+		if (ret) {
+			shm = NULL;
+			return ret;
+		}
+		log_info("publish: ring of %d windows handed out over the "
+			 "control socket (%zu KB)", COUNTER_SHM_RING_SIZE,
+			 shm_len / 1024);
+	} else {
+		log_info("publish: ring of %d windows at shm key 0x%x (%zu KB)",
+			 COUNTER_SHM_RING_SIZE, COUNTER_SHM_KEY, shm_len / 1024);
+	}
+
+	return 0;
+}
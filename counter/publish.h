@@ -0,0 +1,11 @@
+/*
+ * publish.h - publishes each sampling window into a shared memory ring
+ */
+
+#pragma once
+
+#include <counter/shm.h>
+
+extern int publish_init(void);
+extern struct counter_shm_window *publish_begin(void);
+extern void publish_end(struct counter_shm_window *w);
@@ -0,0 +1,688 @@
+/*
+ * resctrl.c - per-cgroup cache and memory bandwidth monitoring and
+ * partitioning with Intel RDT
+ *
+ * Every cgroup counterd reports gets a resctrl monitoring group holding its
+ * threads. Each window, the group's cache occupancy (CMT) and total and
+ * local memory bandwidth counters (MBM) are read on every L3 domain and
+ * summed. Threads inherit their creator's group, but processes moved into
+ * the cgroup later do not, so a group's tasks are synced again every
+ * RDT_SYNC_WINDOWS windows.
+ *
+ * With 'partition', cgroups using more memory bandwidth than a limit are
+ * also moved into control groups of their own, whose LLC ways (CAT) and
+ * memory bandwidth (MBA) are adjusted every RDT_CTRL_WINDOWS windows; see
+ * rdt_ctrl_step().
+ *
+ * The resctrl mount point is cfg.resctrl_root, so all of this also runs
+ * against a directory tree that only mimics resctrl.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/sysfs.h>
+
+#include "defs.h"
+#include "sched.h"
+#include "cgroup.h"
+#include "resctrl.h"
+
+#define RDT_GROUP_PREFIX	"counterd-"
+/* windows between syncing a group's tasks with its cgroup */
+#define RDT_SYNC_WINDOWS	50
+/* the most L3 domains (one per socket, or more with sub-NUMA clustering) */
+#define RDT_MAX_DOMAINS		16
+/* windows between partitioning decisions */
+#define RDT_CTRL_WINDOWS	10
+/* the MPKI increase after a cut that marks a cgroup as cache sensitive */
+#define RDT_CTRL_SENSITIVITY	0.2
+/* bandwidth must drop this far below the limit before loosening */
+#define RDT_CTRL_HYSTERESIS	0.5
+/* the MBA change per step (%) */
+#define RDT_CTRL_MBA_STEP	10
+
+enum {
+	RDT_LLC_OCCUPANCY = 0,
+	RDT_MBM_TOTAL,
+	RDT_MBM_LOCAL,
+	RDT_NR_EVENTS,
+};
+
+static const char *rdt_event_names[RDT_NR_EVENTS] = {
+	[RDT_LLC_OCCUPANCY]	= "llc_occupancy",
+	[RDT_MBM_TOTAL]		= "mbm_total_bytes",
+	[RDT_MBM_LOCAL]		= "mbm_local_bytes",
+};
+
+/* the events this machine can monitor */
+static bool rdt_events[RDT_NR_EVENTS];
+/* the L3 domain ids */
+static unsigned int rdt_domains[RDT_MAX_DOMAINS];
+static unsigned int rdt_nr_domains;
+
+/* the cgroups that have a group, to remove them at exit */
+static struct cg_stats *rdt_groups[CG_MAX];
+static unsigned int rdt_nr_groups;
+
+/* allocation: the resources, and the limits resctrl puts on them */
+static bool rdt_cat, rdt_mba;
+static unsigned int rdt_cbm_bits, rdt_min_cbm_bits;
+static unsigned int rdt_mba_min, rdt_mba_gran;
+static unsigned int rdt_nr_closids, rdt_nr_ctrl;
+static unsigned int rdt_ctrl_windows;
+
+static void rdt_mon_dir(struct cg_stats *cg, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s/mon_groups/" RDT_GROUP_PREFIX "%" PRIu64,
+		 cfg.resctrl_root, cg->id);
+}
+
+static void rdt_ctrl_dir(struct cg_stats *cg, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s/" RDT_GROUP_PREFIX "%" PRIu64, cfg.resctrl_root,
+		 cg->id);
+}
+
+/* the group holding a cgroup's threads (a control group monitors itself) */
+static void rdt_group_dir(struct cg_stats *cg, char *buf, size_t len)
+{
+	if (cg->rdt_ctrl)
+		rdt_ctrl_dir(cg, buf, len);
+	else
+		rdt_mon_dir(cg, buf, len);
+}
+
+/* moves every thread of a cgroup into its group */
+static int rdt_sync_tasks(struct cg_stats *cg, const char *dir)
+{
+	char path[PATH_MAX + 16], buf[16];
+	int fd, out, tid, len;
+	FILE *f;
+
+	fd = cg_open(cg->path, "cgroup.threads", O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return -errno;
+	}
+
+	/* O_CREAT is a no-op on resctrl, but lets a mock tree be used */
+	snprintf(path, sizeof(path), "%s/tasks", dir);
+	out = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (out < 0) {
+		fclose(f);
+		return -errno;
+	}
+
+	/* resctrl takes one thread per write; threads may exit meanwhile */
+	while (fscanf(f, "%d", &tid) == 1) {
+		len = snprintf(buf, sizeof(buf), "%d\n", tid);
+		if (write(out, buf, len) < 0 && errno != ESRCH)
+			log_warn_once("rdt: could not move thread %d (%s)", tid,
+				      strerror(errno));
+	}
+
+	close(out);
+	fclose(f);
+	return 0;
+}
+
+static int rdt_create_group(struct cg_stats *cg, const char *dir)
+{
+	/* a group left by an earlier run is taken over */
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		if (errno == ENOSPC)
+			log_warn_once("rdt: out of monitoring IDs, some cgroups "
+				      "are not monitored");
+		else
+			log_warn("rdt: could not create %s (%s)", dir,
+				 strerror(errno));
+		return -errno;
+	}
+
+	rdt_groups[rdt_nr_groups++] = cg;
+	cg->rdt_mon = true;
+	return 0;
+}
+
+/* sums an event over every L3 domain */
+static int rdt_read_event(const char *dir, int event, uint64_t *val)
+{
+	char path[PATH_MAX + 64];
+	uint64_t v;
+	unsigned int i;
+	int ret;
+
+	*val = 0;
+	for (i = 0; i < rdt_nr_domains; i++) {
+		snprintf(path, sizeof(path), "%s/mon_data/mon_L3_%02u/%s", dir,
+			 rdt_domains[i], rdt_event_names[event]);
+		ret = sysfs_parse_val(path, &v);
+		if (ret)
+			return ret;
+		*val += v;
+	}
+
+	return 0;
+}
+
+static void rdt_read_group(struct cg_stats *cg, const char *dir)
+{
+	uint64_t total, local, occupancy, us;
+
+	if (rdt_events[RDT_LLC_OCCUPANCY] &&
+	    !rdt_read_event(dir, RDT_LLC_OCCUPANCY, &occupancy))
+		cg->llc_occupancy = occupancy;
+
+	if (!rdt_events[RDT_MBM_TOTAL] ||
+	    rdt_read_event(dir, RDT_MBM_TOTAL, &total))
+		return;
+	if (!rdt_events[RDT_MBM_LOCAL] ||
+	    rdt_read_event(dir, RDT_MBM_LOCAL, &local))
+		local = 0;
+
+	/* bytes per us is MB/s */
+	us = now_us - cg->mbm_at_us;
+	if (cg->mbm_at_us && us && total >= cg->mbm_total &&
+	    local >= cg->mbm_local) {
+		cg->mbm_total_mbps = (float)(total - cg->mbm_total) / us;
+		cg->mbm_local_mbps = (float)(local - cg->mbm_local) / us;
+	}
+	cg->mbm_total = total;
+	cg->mbm_local = local;
+	cg->mbm_at_us = now_us;
+}
+
+static int rdt_write_schemata(const char *dir, const char *schemata)
+{
+	char path[PATH_MAX + 16];
+	ssize_t ret;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/schemata", dir);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+	ret = write(fd, schemata, strlen(schemata));
+	close(fd);
+	return ret < 0 ? -errno : 0;
+}
+
+/* formats a cgroup's schemata, the same on every domain */
+static void rdt_format_schemata(struct cg_stats *cg, char *buf, size_t len)
+{
+	uint64_t mask = (1UL << cg->rdt_ways) - 1;
+	unsigned int i;
+	int n = 0;
+
+	buf[0] = '\0';
+	if (rdt_cat) {
+		n += snprintf(buf + n, len - n, "L3:");
+		for (i = 0; i < rdt_nr_domains; i++)
+			n += snprintf(buf + n, len - n, "%s%u=%" PRIx64,
+				      i ? ";" : "", rdt_domains[i], mask);
+		n += snprintf(buf + n, len - n, "\n");
+	}
+	if (rdt_mba) {
+		n += snprintf(buf + n, len - n, "MB:");
+		for (i = 0; i < rdt_nr_domains; i++)
+			n += snprintf(buf + n, len - n, "%s%u=%u", i ? ";" : "",
+				      rdt_domains[i], cg->rdt_mba);
+		n += snprintf(buf + n, len - n, "\n");
+	}
+}
+
+static void rdt_apply(struct cg_stats *cg)
+{
+	char dir[PATH_MAX], buf[64 + RDT_MAX_DOMAINS * 32];
+	int ret;
+
+	log_info("NOW: %" PRIu64 " | rdt: cgroup %s gets %u of %u LLC ways, "
+		 "%u%% memory bandwidth", now_us, cg->path, cg->rdt_ways,
+		 rdt_cbm_bits, cg->rdt_mba);
+	if (cfg.dry_run)
+		return;
+
+	rdt_ctrl_dir(cg, dir, sizeof(dir));
+	rdt_format_schemata(cg, buf, sizeof(buf));
+	ret = rdt_write_schemata(dir, buf);
+	if (ret)
+		log_warn("rdt: could not write the schemata of %s (%s)", dir,
+			 strerror(-ret));
+}
+
+/* moves a cgroup into a control group of its own */
+static void rdt_partition(struct cg_stats *cg)
+{
+	char dir[PATH_MAX];
+
+	/* the default group keeps a CLOS of its own */
+	if (rdt_nr_ctrl + 1 >= rdt_nr_closids) {
+		log_warn_once("rdt: out of CLOS IDs, some cgroups can't be "
+			      "partitioned");
+		return;
+	}
+
+	cg->rdt_partitioned = true;
+	cg->rdt_ways = MAX(rdt_cbm_bits / 2, rdt_min_cbm_bits);
+	cg->rdt_mba = 100;
+	rdt_nr_ctrl++;
+
+	if (!cfg.dry_run) {
+		rdt_ctrl_dir(cg, dir, sizeof(dir));
+		if (mkdir(dir, 0755) && errno != EEXIST) {
+			log_warn("rdt: could not create %s (%s)", dir,
+				 strerror(errno));
+			cg->rdt_failed = true;
+			cg->rdt_partitioned = false;
+			rdt_nr_ctrl--;
+			return;
+		}
+		cg->rdt_ctrl = true;
+		/* its bandwidth counters start over in the new group */
+		cg->mbm_at_us = 0;
+	}
+
+	rdt_apply(cg);
+	if (cg->rdt_ctrl)
+		rdt_sync_tasks(cg, dir);
+}
+
+/* hands a cgroup back to the default group */
+static void rdt_unpartition(struct cg_stats *cg)
+{
+	char dir[PATH_MAX];
+
+	log_info("NOW: %" PRIu64 " | rdt: released cgroup %s", now_us, cg->path);
+	if (cg->rdt_ctrl) {
+		rdt_ctrl_dir(cg, dir, sizeof(dir));
+		rmdir(dir);
+		cg->rdt_ctrl = false;
+		cg->mbm_at_us = 0;
+		/* its threads are in the default group, not its monitoring one */
+		cg->rdt_sync = 0;
+	}
+	cg->rdt_partitioned = false;
+	rdt_nr_ctrl--;
+}
+
+/**
+ * rdt_release - removes a cgroup's resctrl groups
+ * @cg: the cgroup, about to be forgotten
+ *
+ * Its threads, if any are left, go back to the default group.
+ */
+void rdt_release(struct cg_stats *cg)
+{
+	char dir[PATH_MAX];
+	unsigned int i;
+
+	if (cg->rdt_partitioned)
+		rdt_unpartition(cg);
+	if (!cg->rdt_mon)
+		return;
+
+	rdt_mon_dir(cg, dir, sizeof(dir));
+	rmdir(dir);
+	cg->rdt_mon = false;
+	for (i = 0; i < rdt_nr_groups; i++) {
+		if (rdt_groups[i] == cg) {
+			rdt_groups[i] = rdt_groups[--rdt_nr_groups];
+			break;
+		}
+	}
+}
+
+/**
+ * rdt_ctrl_step - adjusts the partition of a cgroup
+ * @cg: the cgroup
+ * @mbps: its memory bandwidth over the last period
+ * @mpki: its LLC misses per kilo-instruction over the last period
+ *
+ * A cgroup above the bandwidth limit first gets half the LLC ways. After each
+ * cut, its MPKI tells whether it is cache sensitive: if it rose, the ways are
+ * given back and its memory bandwidth is cut through MBA instead; if it did
+ * not (a streaming workload), its ways keep being halved, then its bandwidth
+ * is cut. Once its bandwidth is well below the limit, the cuts are undone
+ * step by step and the cgroup is released.
+ */
+static void rdt_ctrl_step(struct cg_stats *cg, float mbps, float mpki)
+{
+	unsigned int ways = cg->rdt_ways, mba = cg->rdt_mba;
+	unsigned int step = MAX(RDT_CTRL_MBA_STEP, rdt_mba_gran);
+	bool sensitive;
+
+	if (!cg->rdt_partitioned) {
+		if (mbps > cfg.rdt_partition_mbps)
+			rdt_partition(cg);
+		return;
+	}
+
+	if (mbps < cfg.rdt_partition_mbps * RDT_CTRL_HYSTERESIS) {
+		if (mba < 100)
+			mba = MIN(mba + step, 100);
+		else if (ways < rdt_cbm_bits)
+			ways = MIN(ways * 2, rdt_cbm_bits);
+		else {
+			rdt_unpartition(cg);
+			return;
+		}
+	} else if (mbps > cfg.rdt_partition_mbps) {
+		sensitive = cg->rdt_last_mpki &&
+			    mpki > cg->rdt_last_mpki * (1 + RDT_CTRL_SENSITIVITY);
+		if (rdt_cat && !sensitive && ways > rdt_min_cbm_bits) {
+			ways = MAX(ways / 2, rdt_min_cbm_bits);
+		} else {
+			if (sensitive)
+				ways = MIN(ways * 2, rdt_cbm_bits);
+			if (rdt_mba && mba > rdt_mba_min)
+				mba = MAX(mba - step, rdt_mba_min);
+		}
+	}
+
+	if (ways == cg->rdt_ways && mba == cg->rdt_mba)
+		return;
+	cg->rdt_ways = ways;
+	cg->rdt_mba = mba;
+	rdt_apply(cg);
+}
+
+static void rdt_ctrl_poll(void)
+{
+	struct cg_stats *cg;
+	float mbps, mpki;
+	unsigned int i;
+
+	for (i = 0; i < cg_nr; i++) {
+		cg = cg_list[i];
+		cg->rdt_windows++;
+		cg->rdt_misses += cg->misses;
+		cg->rdt_instrs += cg->instrs;
+		/* measured bandwidth beats the estimate from LLC misses */
+		cg->rdt_mbps += cg->mbm_at_us ? cg->mbm_total_mbps : cg->mbps;
+	}
+
+	if (++rdt_ctrl_windows < RDT_CTRL_WINDOWS)
+		return;
+	rdt_ctrl_windows = 0;
+
+	for (i = 0; i < cg_nr; i++) {
+		cg = cg_list[i];
+		if (cg->rdt_failed || !cg->id || !strcmp(cg->path, "/"))
+			continue;
+
+		mbps = cg->rdt_mbps / cg->rdt_windows;
+		mpki = cg->rdt_instrs ?
+		       (float)cg->rdt_misses * 1000 / cg->rdt_instrs : 0;
+		rdt_ctrl_step(cg, mbps, mpki);
+
+		cg->rdt_last_mpki = mpki;
+		cg->rdt_windows = 0;
+		cg->rdt_misses = cg->rdt_instrs = 0;
+		cg->rdt_mbps = 0;
+	}
+}
+
+/**
+ * rdt_set_schemata - sets the LLC ways and memory bandwidth of a resctrl
+ * group on one domain
+ * @group: the group, relative to the resctrl root (created if missing)
+ * @domain: the L3 domain (the socket, unless sub-NUMA clustering is on)
+ * @l3_mask: the LLC capacity bitmask, or 0 to leave it
+ * @mba: the memory bandwidth (%), or 0 to leave it
+ *
+ * Only logs the change in a dry run. Returns 0 if successful.
+ */
+int rdt_set_schemata(const char *group, unsigned int domain,
+		     uint64_t l3_mask, unsigned int mba)
+{
+	char dir[PATH_MAX], buf[64];
+	int n = 0;
+
+	if (cfg.dry_run) {
+		log_info("rdt: would set group %s on domain %u to L3 %" PRIx64
+			 ", MB %u%%", group, domain, l3_mask, mba);
+		return 0;
+	}
+
+	snprintf(dir, sizeof(dir), "%s/%s", cfg.resctrl_root, group);
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return -errno;
+
+	if (l3_mask)
+		n += snprintf(buf + n, sizeof(buf) - n, "L3:%u=%" PRIx64 "\n",
+			      domain, l3_mask);
+	if (mba)
+		n += snprintf(buf + n, sizeof(buf) - n, "MB:%u=%u\n", domain,
+			      mba);
+	return n ? rdt_write_schemata(dir, buf) : 0;
+}
+
+/**
+ * rdt_poll - reads the RDT counters of the cgroups seen in this window
+ *
+ * Call after the window's processes have been rolled up into cg_list.
+ */
+void rdt_poll(void)
+{
+	char dir[PATH_MAX];
+	struct cg_stats *cg;
+	unsigned int i;
+
+	if (!cfg.rdt)
+		return;
+
+	for (i = 0; i < cg_nr; i++) {
+		cg = cg_list[i];
+		/* the root cgroup's processes stay in the default group */
+		if (cg->rdt_failed || !cg->id || !strcmp(cg->path, "/"))
+			continue;
+
+		rdt_group_dir(cg, dir, sizeof(dir));
+		if (!cg->rdt_mon && rdt_create_group(cg, dir)) {
+			cg->rdt_failed = true;
+			continue;
+		}
+		if (cg->rdt_sync-- == 0) {
+			rdt_sync_tasks(cg, dir);
+			cg->rdt_sync = RDT_SYNC_WINDOWS;
+		}
+
+		rdt_read_group(cg, dir);
+	}
+
+	if (cfg.rdt_partition_mbps)
+		rdt_ctrl_poll();
+}
+
+static void rdt_exit(void)
+{
+	char dir[PATH_MAX];
+	unsigned int i;
+
+	/* removing a group hands its threads back to the default group */
+	for (i = 0; i < rdt_nr_groups; i++) {
+		if (rdt_groups[i]->rdt_ctrl) {
+			rdt_ctrl_dir(rdt_groups[i], dir, sizeof(dir));
+			rmdir(dir);
+		}
+		rdt_mon_dir(rdt_groups[i], dir, sizeof(dir));
+		rmdir(dir);
+	}
+}
+
+/* removes the groups a previous run left behind in @parent */
+static void rdt_remove_stale(const char *parent)
+{
+	char dir[PATH_MAX];
+	struct dirent *ent;
+	DIR *d;
+
+	d = opendir(parent);
+	if (!d)
+		return;
+	while ((ent = readdir(d))) {
+		if (strncmp(ent->d_name, RDT_GROUP_PREFIX,
+			    strlen(RDT_GROUP_PREFIX)))
+			continue;
+		snprintf(dir, sizeof(dir), "%s/%s", parent, ent->d_name);
+		if (!rmdir(dir))
+			log_info("rdt: removed stale group %s", dir);
+	}
+	closedir(d);
+}
+
+/* finds the L3 domains from the default group's mon_data */
+static int rdt_find_domains(void)
+{
+	char path[PATH_MAX];
+	struct dirent *ent;
+	unsigned int id;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "%s/mon_data", cfg.resctrl_root);
+	dir = opendir(path);
+	if (!dir)
+		return -errno;
+	while ((ent = readdir(dir)) != NULL &&
+	       rdt_nr_domains < RDT_MAX_DOMAINS) {
+		if (sscanf(ent->d_name, "mon_L3_%u", &id) == 1)
+			rdt_domains[rdt_nr_domains++] = id;
+	}
+	closedir(dir);
+
+	return rdt_nr_domains ? 0 : -ENODEV;
+}
+
+static int rdt_parse_info(const char *file, uint64_t *val, bool hex)
+{
+	char path[PATH_MAX + 32], buf[32];
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/info/%s", cfg.resctrl_root, file);
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+	ret = fgets(buf, sizeof(buf), f) ? 0 : -EIO;
+	fclose(f);
+	if (ret)
+		return ret;
+
+	*val = strtoull(buf, NULL, hex ? 16 : 10);
+	return 0;
+}
+
+/* finds which resources can be allocated, and their limits */
+static int rdt_ctrl_init(void)
+{
+	uint64_t mask = 0, bits = 0, min_bw = 0, gran = 0, closids = 0;
+
+	if (!rdt_parse_info("L3/cbm_mask", &mask, true) &&
+	    !rdt_parse_info("L3/min_cbm_bits", &bits, false) &&
+	    !rdt_parse_info("L3/num_closids", &closids, false)) {
+		rdt_cat = true;
+		rdt_cbm_bits = __builtin_popcountll(mask);
+		rdt_min_cbm_bits = MAX(bits, 1);
+		rdt_nr_closids = closids;
+	}
+	if (!rdt_parse_info("MB/min_bandwidth", &min_bw, false) &&
+	    !rdt_parse_info("MB/bandwidth_gran", &gran, false) &&
+	    !rdt_parse_info("MB/num_closids", &closids, false)) {
+		rdt_mba = true;
+		rdt_mba_min = min_bw;
+		rdt_mba_gran = gran;
+		rdt_nr_closids = rdt_cat ? MIN(rdt_nr_closids, closids) :
+					   closids;
+	}
+
+	if (!rdt_cat && !rdt_mba) {
+		log_err("rdt: neither L3 nor MB allocation at %s",
+			cfg.resctrl_root);
+		return -ENODEV;
+	}
+
+	/* CAT stays untouched without it, so the masks are always full */
+	if (!rdt_cat)
+		rdt_cbm_bits = rdt_min_cbm_bits = 1;
+
+	log_info("rdt: partitioning cgroups above %.1f MB/s (%u LLC ways, MBA "
+		 "%s, %u CLOS IDs)%s", cfg.rdt_partition_mbps,
+		 rdt_cat ? rdt_cbm_bits : 0, rdt_mba ? "on" : "off",
+		 rdt_nr_closids, cfg.dry_run ? ", dry run" : "");
+	return 0;
+}
+
+/**
+ * rdt_init - checks which RDT events resctrl can monitor
+ *
+ * Returns 0 if successful.
+ */
+int rdt_init(void)
+{
+	char path[PATH_MAX], line[64];
+	int i, ret;
+	FILE *f;
+
+	if (!cfg.rdt)
+		return 0;
+	if (cfg.replay_path) {
+		log_warn("rdt: a replayed trace has no cgroups to monitor");
+		cfg.rdt = false;
+		return 0;
+	}
+
+	snprintf(path, sizeof(path), "%s/info/L3_MON/mon_features",
+		 cfg.resctrl_root);
+	f = fopen(path, "r");
+	if (!f) {
+		log_err("rdt: no L3 monitoring at %s (is resctrl mounted?)",
+			cfg.resctrl_root);
+		return -ENODEV;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		for (i = 0; i < RDT_NR_EVENTS; i++) {
+			if (!strcmp(line, rdt_event_names[i]))
+				rdt_events[i] = true;
+		}
+	}
+	fclose(f);
+
+	/* a killed run could not restore its groups' threads */
+	snprintf(path, sizeof(path), "%s/mon_groups", cfg.resctrl_root);
+	rdt_remove_stale(path);
+	rdt_remove_stale(cfg.resctrl_root);
+
+	ret = rdt_find_domains();
+	if (ret) {
+		log_err("rdt: could not find the L3 domains (%s)",
+			strerror(-ret));
+		return ret;
+	}
+
+	if (cfg.rdt_partition_mbps) {
+		ret = rdt_ctrl_init();
+		if (ret)
+			return ret;
+	}
+
+	atexit(rdt_exit);
+	for (i = 0; i < RDT_NR_EVENTS; i++) {
+		if (rdt_events[i])
+			log_info("rdt: monitoring %s on %u L3 domains",
+				 rdt_event_names[i], rdt_nr_domains);
+	}
+	return 0;
+}
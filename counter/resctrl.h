@@ -0,0 +1,15 @@
+/*
+ * resctrl.h - Intel RDT monitoring and allocation through resctrl
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+struct cg_stats;
+
+extern int rdt_init(void);
+extern void rdt_poll(void);
+extern void rdt_release(struct cg_stats *cg);
+extern int rdt_set_schemata(const char *group, unsigned int domain,
+			    uint64_t l3_mask, unsigned int mba);
@@ -0,0 +1,83 @@
+/*
+ * sample.h - backends that sample per-core performance counters
+ */
+
+#pragma once
+
+#include <base/stddef.h>
+#include <base/bitmap.h>
+
+#include "ksched.h"
+
+/* one core's counters at the boundary of a sampling window */
+struct pmc_sample {
+	uint64_t gen;
+	struct ksched_pmc_sample pmc;
+};
+
+/*
+ * A sampling backend reads the same group of counters on every core in
+ * sample_cores at each window boundary. Samples are indexed by core number.
+ */
+struct sample_ops {
+	const char	*name;
+
+	/**
+	 * init - prepares to sample a group of counters
+	 * @sel: an array of architecture-specific counter selectors
+	 * @nr: the number of selectors (at most KSCHED_NR_PMC)
+	 *
+	 * Returns 0 if successful.
+	 */
+	int (*init)(const uint64_t *sel, unsigned int nr);
+
+	/**
+	 * request - starts sampling every allowed core
+	 * @samples: the array that the results will be gathered into
+	 */
+	void (*request)(struct pmc_sample *samples);
+
+	/**
+	 * gather - collects the results of the last request
+	 * @samples: the array to store the results
+	 *
+	 * Returns the number of cores that could not be sampled.
+	 */
+	unsigned int (*gather)(struct pmc_sample *samples);
+
+	/**
+	 * cost - reports the time spent sampling on the sampled cores
+	 *
+	 * Optional, for backends that interrupt the sampled cores.
+	 *
+	 * Returns the total TSC cycles spent so far, summed over all cores.
+	 */
+	uint64_t (*cost)(void);
+};
+
+/* the cores to sample this window (see subsample.c) */
+DECLARE_BITMAP(sample_cores, NCPU);
+/* the cores found idle all window and not sampled (ksched only) */
+extern unsigned int sample_idle_skipped;
+
+extern const struct sample_ops *sample_ops;
+extern const struct sample_ops ksched_sample_ops;
+extern const struct sample_ops perf_sample_ops;
+extern const struct sample_ops replay_sample_ops;
+
+/*
+ * Trace recording and replay
+ */
+
+extern uint64_t replay_window_tsc;
+extern int replay_cycles_per_us;
+extern unsigned int replay_nr_sockets;
+extern unsigned int replay_nr_channels;
+
+extern uint64_t replay_get_cas(unsigned int socket, unsigned int channel,
+			       bool write);
+extern int record_open(const char *path, unsigned int nr_sockets,
+		       unsigned int nr_channels);
+extern void record_window(struct pmc_sample *samples);
+extern void record_cas(unsigned int socket, unsigned int channel, uint64_t rd,
+		       uint64_t wr);
@@ -0,0 +1,262 @@
+/*
+ * sample_ksched.c - samples counters through the ksched kernel module
+ *
+ * This is the low-latency backend. Depending on cfg.ias_sample, counters
+ * are read by asynchronous IPIs, by per-CPU kernel timers or by one
+ * synchronous ioctl per window.
+ *
+ * With 'idleskip' (and ksched loaded with idleskip=1 or tasks=1), a core
+ * that stayed idle for the whole window (idle at both of its ends, never
+ * woken in between, as ksched tracks from context switches) is not
+ * interrupted. Its last sample is reused with the current TSC, so the window
+ * reads as zero deltas. Work done in interrupts on an idle core shows up
+ * once the core is sampled again, at the latest after KSCHED_IDLE_MAX_SKIP
+ * windows.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+
+#include "defs.h"
+#include "sched.h"
+#include "ksched.h"
+#include "sample.h"
+
+/* an idle core is still sampled at least this often (in windows) */
+#define KSCHED_IDLE_MAX_SKIP	10
+/* whether ksched probes context switches to track idle CPUs */
+#define KSCHED_IDLESKIP_PARAM	"/sys/module/ksched/parameters/idleskip"
+
+static const uint64_t *ksched_sel;
+static unsigned int ksched_nr_sel;
+
+/* the cores skipped as idle when the last window was gathered */
+unsigned int sample_idle_skipped;
+
+struct ksched_idle {
+	uint64_t	wakeups;	/* the wakeup count at the last request */
+	uint64_t	tsc;		/* when the core was last skipped */
+	unsigned int	skipped;	/* windows skipped in a row */
+	bool		idle;		/* idle at the last request */
+	bool		skip;		/* skipped in the current window */
+	bool		valid;		/* @last holds a sample */
+	struct ksched_pmc_sample last;	/* the last sample taken */
+};
+
+static struct ksched_idle ksched_idle[NCPU];
+
+/* decides whether a core can be skipped in the window ending now */
+static bool ksched_idle_check(unsigned int core)
+{
+	struct ksched_idle *d = &ksched_idle[core];
+	bool idle = ksched_poll_idle(core);
+	uint64_t wakeups = ACCESS_ONCE(ksched_shm[core].wakeups);
+
+	d->skip = cfg.ias_idle_skip && d->valid && idle && d->idle &&
+		  wakeups == d->wakeups && d->skipped < KSCHED_IDLE_MAX_SKIP;
+	d->idle = idle;
+	d->wakeups = wakeups;
+	if (!d->skip) {
+		d->skipped = 0;
+		return false;
+	}
+
+	d->skipped++;
+	d->tsc = rdtsc();
+	return true;
+}
+
+/* stores a core's sample, or its last one if it was skipped */
+static bool ksched_idle_fill(unsigned int core, struct ksched_pmc_sample *s,
+			     bool ok)
+{
+	struct ksched_idle *d = &ksched_idle[core];
+
+	if (d->skip) {
+		*s = d->last;
+		s->tsc = d->tsc;
+		sample_idle_skipped++;
+		return true;
+	}
+	if (ok) {
+		d->last = *s;
+		d->valid = true;
+	}
+	return ok;
+}
+
+/* the allowed cores and result buffer for synchronous sampling */
+static cpu_set_t ksched_sample_mask;
+static struct ksched_sample_res ksched_sample_res[NCPU];
+
+/* samples every core in sample_cores with one synchronous ioctl */
+static unsigned int ksched_sample_sync(struct pmc_sample *samples)
+{
+	cpu_set_t *mask = &ksched_sample_mask, subset;
+	int i, ret, core, tmp, nr = sched_cores_nr;
+
+	if (cfg.ias_subsample || cfg.ias_idle_skip) {
+		CPU_ZERO(&subset);
+		sched_for_each_allowed_core(core, tmp) {
+			if (!bitmap_test(sample_cores, core))
+				continue;
+			if (ksched_idle_check(core))
+				ksched_idle_fill(core, &samples[core].pmc, true);
+			else
+				CPU_SET(core, &subset);
+		}
+		mask = &subset;
+		nr = CPU_COUNT(&subset);
+	}
+
+	ret = ksched_sample_pmc(mask, ksched_sample_res, NCPU);
+	if (unlikely(ret < 0)) {
+		log_warn_ratelimited("ksched: synchronous sampling failed (%d)",
+				     errno);
+		return nr;
+	}
+
+	for (i = 0; i < ret; i++) {
+		core = ksched_sample_res[i].cpu;
+		samples[core].pmc = ksched_sample_res[i].pmc;
+		ksched_idle_fill(core, &samples[core].pmc, true);
+	}
+	return nr - ret;
+}
+
+static void ksched_sample_request(struct pmc_sample *samples)
+{
+	int core, tmp;
+
+	/*
+	 * The timers fill the rings on their own, and synchronous samples are
+	 * taken by ksched_sample_gather().
+	 */
+	if (cfg.ias_sample != IAS_SAMPLE_IPI)
+		return;
+
+	sched_for_each_allowed_core(core, tmp) {
+		if (bitmap_test(sample_cores, core) && !ksched_idle_check(core))
+			ksched_enqueue_pmc(core, ksched_sel, ksched_nr_sel);
+	}
+}
+
+static unsigned int ksched_sample_gather(struct pmc_sample *samples)
+{
+	unsigned int failures = 0;
+	int core, tmp;
+	bool ok;
+
+	sample_idle_skipped = 0;
+	if (cfg.ias_sample == IAS_SAMPLE_SYNC)
+		return ksched_sample_sync(samples);
+
+	sched_for_each_allowed_core(core, tmp) {
+		if (!bitmap_test(sample_cores, core))
+			continue;
+		if (cfg.ias_sample == IAS_SAMPLE_TIMER)
+			ok = ksched_poll_ring(core, &samples[core].pmc);
+		else if (ksched_idle[core].skip)
+			ok = true;
+		else
+			ok = ksched_poll_pmc(core, &samples[core].pmc);
+		if (!ksched_idle_fill(core, &samples[core].pmc, ok))
+			failures++;
+	}
+
+	return failures;
+}
+
+static uint64_t ksched_sample_cost(void)
+{
+	uint64_t cycles = 0;
+	int core, tmp;
+
+	sched_for_each_allowed_core(core, tmp)
+		cycles += ACCESS_ONCE(ksched_shm[core].sample_cycles);
+	return cycles;
+}
+
+/* true if ksched keeps each CPU's busy flag and wakeup count */
+static bool ksched_idle_tracked(void)
+{
+	char val = 'N';
+	FILE *f;
+
+	/* the per-process counters need the same probe */
+	if (ksched_tasks)
+		return true;
+
+	f = fopen(KSCHED_IDLESKIP_PARAM, "r");
+	if (!f)
+		return false;
+	if (fread(&val, 1, 1, f) != 1)
+		val = 'N';
+	fclose(f);
+	return val == 'Y';
+}
+
+static int ksched_sample_init(const uint64_t *sel, unsigned int nr)
+{
+	int core, tmp, ret;
+
+	ret = ksched_init();
+	if (ret)
+		return ret;
+
+	if (cfg.ias_idle_skip && !ksched_idle_tracked()) {
+		log_warn("ksched: load it with idleskip=1 to skip idle cores");
+		cfg.ias_idle_skip = false;
+	}
+
+	ksched_sel = sel;
+	ksched_nr_sel = nr;
+
+	ret = ksched_setup_pmc(sel, nr);
+	if (ret) {
+		log_err("ksched: could not reserve performance counters (%s)",
+			strerror(errno));
+		return -errno;
+	}
+
+	/*
+	 * The timer and synchronous modes read the selectors straight from
+	 * the shm, so they are written once here.
+	 */
+	CPU_ZERO(&ksched_sample_mask);
+	sched_for_each_allowed_core(core, tmp) {
+		ksched_set_pmc(core, sel, nr);
+		CPU_SET(core, &ksched_sample_mask);
+	}
+
+	if (cfg.ias_sample != IAS_SAMPLE_TIMER)
+		return 0;
+
+	if (cfg.ias_idle_skip) {
+		log_warn("ksched: the kernel timers sample idle cores anyway");
+		cfg.ias_idle_skip = false;
+	}
+
+	ret = ksched_arm_timers(cfg.ias_timer_us * 1000, &ksched_sample_mask);
+	if (ret) {
+		log_err("ksched: could not start the sampling timers (%s)",
+			strerror(errno));
+		return -errno;
+	}
+
+	log_info("ksched: sampling with kernel timers every %" PRIu64 " us",
+		 cfg.ias_timer_us);
+	return 0;
+}
+
+const struct sample_ops ksched_sample_ops = {
+	.name		= "ksched",
+	.init		= ksched_sample_init,
+	.request	= ksched_sample_request,
+	.gather		= ksched_sample_gather,
+	.cost		= ksched_sample_cost,
+};
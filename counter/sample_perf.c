@@ -0,0 +1,241 @@
+/*
+ * sample_perf.c - samples counters through perf_event_open()
+ *
+ * This is the portable backend: it needs no kernel module, only a kernel
+ * with perf events and the privilege to open per-CPU counters. Each allowed
+ * core gets one counter group that is read with PERF_FORMAT_GROUP, so all
+ * values in a sample cover the same window.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+
+#include "defs.h"
+#include "sched.h"
+#include "sample.h"
+#include "pmc.h"
+
+/* the msr PMU's event numbers (see arch/x86/events/msr.c) */
+#define PERF_MSR_APERF		1
+#define PERF_MSR_MPERF		2
+
+/* the group leader is the first selector, followed by the fixed events */
+#define PERF_GROUP_MAX		(KSCHED_NR_PMC + KSCHED_NR_FIXED)
+
+struct perf_group_read {
+	uint64_t nr;
+	uint64_t time_enabled;
+	uint64_t time_running;
+	uint64_t values[PERF_GROUP_MAX];
+};
+
+struct perf_core {
+	int		group_fd;
+	int		aperf_fd;
+	int		mperf_fd;
+
+	/* the last group read, so only what was counted since is scaled */
+	uint64_t	enabled;
+	uint64_t	running;
+	uint64_t	raw[PERF_GROUP_MAX];
+	uint64_t	total[PERF_GROUP_MAX];
+};
+
+static struct perf_core perf_cores[NCPU];
+static unsigned int perf_nr_sel;
+static int perf_msr_type = -1;
+
+static const uint64_t perf_fixed_cfg[KSCHED_NR_FIXED] = {
+	[KSCHED_FIXED_INSTR_RETIRED]	= PERF_COUNT_HW_INSTRUCTIONS,
+	[KSCHED_FIXED_CORE_CYCLES]	= PERF_COUNT_HW_CPU_CYCLES,
+	[KSCHED_FIXED_REF_CYCLES]	= PERF_COUNT_HW_REF_CPU_CYCLES,
+};
+
+static int perf_event_open(struct perf_event_attr *attr, int cpu, int group_fd)
+{
+	return syscall(__NR_perf_event_open, attr, -1, cpu, group_fd,
+		       PERF_FLAG_FD_CLOEXEC);
+}
+
+static int perf_open(int cpu, uint32_t type, uint64_t config, bool user,
+		     bool kernel, int group_fd)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_user = !user;
+	attr.exclude_kernel = !kernel;
+	if (group_fd < 0) {
+		attr.read_format = PERF_FORMAT_GROUP |
+				   PERF_FORMAT_TOTAL_TIME_ENABLED |
+				   PERF_FORMAT_TOTAL_TIME_RUNNING;
+	}
+
+	return perf_event_open(&attr, cpu, group_fd);
+}
+
+/* looks up the dynamic type of the msr PMU (for APERF/MPERF) */
+static int perf_msr_pmu_type(void)
+{
+	FILE *f;
+	int type;
+
+	f = fopen("/sys/bus/event_source/devices/msr/type", "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%d", &type) != 1)
+		type = -1;
+	fclose(f);
+	return type;
+}
+
+static int perf_open_core(int cpu, const uint64_t *sel, unsigned int nr)
+{
+	struct perf_core *c = &perf_cores[cpu];
+	unsigned int i;
+	uint64_t config;
+	int fd;
+
+	c->group_fd = c->aperf_fd = c->mperf_fd = -1;
+
+	for (i = 0; i < nr; i++) {
+		/* perf takes the event encoding, not the enable/mode bits */
+		config = sel[i] & ~(PMC_ESEL_USR | PMC_ESEL_OS | PMC_ESEL_INT |
+				    PMC_ESEL_PC | PMC_ESEL_ENABLE);
+		fd = perf_open(cpu, PERF_TYPE_RAW, config, sel[i] & PMC_ESEL_USR,
+			       sel[i] & PMC_ESEL_OS, c->group_fd);
+		if (fd < 0)
+			return -errno;
+		if (c->group_fd < 0)
+			c->group_fd = fd;
+	}
+
+	for (i = 0; i < KSCHED_NR_FIXED; i++) {
+		fd = perf_open(cpu, PERF_TYPE_HARDWARE, perf_fixed_cfg[i],
+			       true, true, c->group_fd);
+		if (fd < 0)
+			return -errno;
+		if (c->group_fd < 0)
+			c->group_fd = fd;
+	}
+
+	/* APERF/MPERF are optional (only needed for cfg.ias_norm == mperf) */
+	if (perf_msr_type >= 0) {
+		c->aperf_fd = perf_open(cpu, perf_msr_type, PERF_MSR_APERF,
+					true, true, -1);
+		c->mperf_fd = perf_open(cpu, perf_msr_type, PERF_MSR_MPERF,
+					true, true, -1);
+	}
+
+	return 0;
+}
+
+static uint64_t perf_read_msr(int fd)
+{
+	struct perf_group_read buf;
+
+	if (fd < 0 || read(fd, &buf, sizeof(buf)) < (ssize_t)(4 * sizeof(uint64_t)))
+		return 0;
+	return buf.values[0];
+}
+
+static bool perf_read_core(int cpu, struct ksched_pmc_sample *res)
+{
+	struct perf_core *c = &perf_cores[cpu];
+	struct perf_group_read buf;
+	uint64_t delta, enabled, running;
+	unsigned int i;
+	ssize_t ret;
+
+	ret = read(c->group_fd, &buf, sizeof(buf));
+	res->tsc = rdtsc();
+	if (ret < (ssize_t)offsetof(struct perf_group_read, values) ||
+	    buf.nr != perf_nr_sel + KSCHED_NR_FIXED)
+		return false;
+
+	enabled = buf.time_enabled - c->enabled;
+	running = buf.time_running - c->running;
+	c->enabled = buf.time_enabled;
+	c->running = buf.time_running;
+
+	for (i = 0; i < buf.nr; i++) {
+		delta = buf.values[i] - c->raw[i];
+		c->raw[i] = buf.values[i];
+
+		/*
+		 * Scale up if the kernel multiplexed the group since the last
+		 * read. Scaling the whole count instead would let the totals
+		 * go down whenever the group's running ratio changes.
+		 */
+		if (running && running < enabled)
+			delta = (double)delta * enabled / running;
+		c->total[i] += delta;
+
+		if (i < perf_nr_sel)
+			res->val[i] = c->total[i];
+		else
+			res->fixed[i - perf_nr_sel] = c->total[i];
+	}
+
+	res->aperf = perf_read_msr(c->aperf_fd);
+	res->mperf = perf_read_msr(c->mperf_fd);
+	return true;
+}
+
+static void perf_sample_request(struct pmc_sample *samples)
+{
+	/* groups are read synchronously by perf_sample_gather() */
+}
+
+static unsigned int perf_sample_gather(struct pmc_sample *samples)
+{
+	unsigned int failures = 0;
+	int core, tmp;
+
+	sched_for_each_allowed_core(core, tmp) {
+		if (!bitmap_test(sample_cores, core))
+			continue;
+		if (!perf_read_core(core, &samples[core].pmc))
+			failures++;
+	}
+
+	return failures;
+}
+
+static int perf_sample_init(const uint64_t *sel, unsigned int nr)
+{
+	int core, tmp, ret;
+
+	perf_nr_sel = nr;
+	perf_msr_type = perf_msr_pmu_type();
+	if (perf_msr_type < 0 && cfg.ias_norm == IAS_NORM_MPERF)
+		log_warn("perf: msr PMU not found, MPERF will read as zero");
+
+	sched_for_each_allowed_core(core, tmp) {
+		ret = perf_open_core(core, sel, nr);
+		if (ret) {
+			log_err("perf: could not open counters on core %d (%s)",
+				core, strerror(-ret));
+			return ret;
+		}
+	}
+
+	log_info("perf: opened counter groups on %d cores", sched_cores_nr);
+	return 0;
+}
+
+const struct sample_ops perf_sample_ops = {
+	.name		= "perf",
+	.init		= perf_sample_init,
+	.request	= perf_sample_request,
+	.gather		= perf_sample_gather,
+};
@@ -0,0 +1,283 @@
+/*
+ * sample_replay.c - records counter samples to a trace and replays them
+ *
+ * A trace is a text file with one record per line:
+ *
+ *	h <cycles per us> <nr sockets> <nr memory channels per socket>
+ *	t <core> [<core> ...]			(the sampled cores)
+ *	w <tsc>					(starts a gather window)
+ *	c <core> <tsc> <pmc0..3> <fixed0..2> <aperf> <mperf> [<pid> <tgid>
+ *	  <nr switches>]
+ *	m <socket> <channel> <read cas count> <write cas count>
+ *
+ * Each gather of the replay backend consumes exactly one window, so a
+ * recorded run is fed through the same ias_bw_poll() state machine and
+ * estimators in the same order it was recorded, without any hardware.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+
+#include "defs.h"
+#include "sched.h"
+#include "sample.h"
+#include "mem_ctrl.h"
+
+#define REPLAY_LINE_MAX		1024
+
+/* the trace being replayed */
+static FILE *replay_file;
+/* the trace being recorded */
+static FILE *record_file;
+
+/* the memory controller CAS counts of the current window */
+static uint64_t replay_cas[NNUMA][MC_MAX_CHANNELS][2];
+static uint64_t replay_first_tsc;
+
+uint64_t replay_window_tsc;
+int replay_cycles_per_us;
+unsigned int replay_nr_sockets;
+unsigned int replay_nr_channels;
+
+static int replay_parse_cores(char *line)
+{
+	char *tok, *saveptr;
+	int core;
+
+	sched_cores_nr = 0;
+	strtok_r(line, " \n", &saveptr);
+	while ((tok = strtok_r(NULL, " \n", &saveptr)) != NULL) {
+		core = atoi(tok);
+		if (core < 0 || core >= NCPU || sched_cores_nr >= NCPU)
+			return -EINVAL;
+		sched_cores_tbl[sched_cores_nr++] = core;
+	}
+
+	return 0;
+}
+
+static int replay_parse_core(const char *line, struct pmc_sample *samples)
+{
+	struct ksched_pmc_sample s;
+	int core, ret;
+
+	/* the UAPI's __u64 is an unsigned long long */
+	memset(&s, 0, sizeof(s));
+	ret = sscanf(line, "c %d %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu"
+		     " %u %u %llu", &core, &s.tsc, &s.val[0], &s.val[1],
+		     &s.val[2], &s.val[3], &s.fixed[0], &s.fixed[1], &s.fixed[2],
+		     &s.aperf, &s.mperf, &s.pid, &s.tgid, &s.nr_switches);
+	/* the running task is optional */
+	if ((ret != 11 && ret != 14) || core < 0 || core >= NCPU)
+		return -EINVAL;
+
+	samples[core].pmc = s;
+	return 0;
+}
+
+static int replay_parse_cas(const char *line)
+{
+	unsigned int socket, channel;
+	uint64_t rd, wr;
+
+	if (sscanf(line, "m %u %u %" SCNu64 " %" SCNu64, &socket, &channel,
+		   &rd, &wr) != 4 ||
+	    socket >= NNUMA || channel >= MC_MAX_CHANNELS)
+		return -EINVAL;
+
+	replay_cas[socket][channel][0] = rd;
+	replay_cas[socket][channel][1] = wr;
+	return 0;
+}
+
+/**
+ * replay_get_cas - gets a memory channel's CAS count for the current window
+ * @socket: the socket of the memory controller
+ * @channel: the channel on the memory controller
+ * @write: get the write CAS count instead of the read one
+ *
+ * Returns the CAS count recorded for the window last gathered.
+ */
+uint64_t replay_get_cas(unsigned int socket, unsigned int channel, bool write)
+{
+	assert(socket < NNUMA && channel < MC_MAX_CHANNELS);
+	return replay_cas[socket][channel][write];
+}
+
+static void replay_sample_request(struct pmc_sample *samples)
+{
+	/* the next window is read from the trace by replay_sample_gather() */
+}
+
+static unsigned int replay_sample_gather(struct pmc_sample *samples)
+{
+	char line[REPLAY_LINE_MAX];
+	bool in_window = false;
+	long pos;
+
+	while (true) {
+		pos = ftell(replay_file);
+		if (!fgets(line, sizeof(line), replay_file))
+			break;
+
+		switch (line[0]) {
+		case 'w':
+			/* the next window starts, leave it for the next gather */
+			if (in_window) {
+				fseek(replay_file, pos, SEEK_SET);
+				return 0;
+			}
+			in_window = true;
+			replay_window_tsc = strtoull(line + 1, NULL, 10);
+			if (!replay_first_tsc)
+				replay_first_tsc = replay_window_tsc;
+			now_us = (replay_window_tsc - replay_first_tsc) /
+				 replay_cycles_per_us;
+			break;
+		case 'c':
+			if (replay_parse_core(line, samples))
+				log_warn("replay: bad core record '%s'", line);
+			break;
+		case 'm':
+			if (replay_parse_cas(line))
+				log_warn("replay: bad memory record '%s'", line);
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (in_window)
+		return 0;
+
+	/* now_us is the wall clock here, so measure the trace itself */
+	log_info("replay: end of trace (%" PRIu64 " us replayed)",
+		 (replay_window_tsc - replay_first_tsc) / replay_cycles_per_us);
+	init_shutdown(EXIT_SUCCESS);
+	return sched_cores_nr;
+}
+
+static int replay_sample_init(const uint64_t *sel, unsigned int nr)
+{
+	char line[REPLAY_LINE_MAX];
+	long pos;
+	int ret;
+
+	replay_file = fopen(cfg.replay_path, "r");
+	if (!replay_file) {
+		log_err("replay: could not open '%s' (%s)", cfg.replay_path,
+			strerror(errno));
+		return -errno;
+	}
+
+	/* the header precedes the first window */
+	while (true) {
+		pos = ftell(replay_file);
+		if (!fgets(line, sizeof(line), replay_file) || line[0] == 'w')
+			break;
+
+		if (line[0] == 'h') {
+			if (sscanf(line, "h %d %u %u", &replay_cycles_per_us,
+				   &replay_nr_sockets, &replay_nr_channels) != 3 ||
+			    replay_nr_sockets > NNUMA ||
+			    replay_nr_channels > MC_MAX_CHANNELS)
+				return -EINVAL;
+		} else if (line[0] == 't') {
+			ret = replay_parse_cores(line);
+			if (ret)
+				return ret;
+		}
+	}
+	fseek(replay_file, pos, SEEK_SET);
+
+	if (replay_cycles_per_us <= 0 || sched_cores_nr == 0) {
+		log_err("replay: '%s' is missing its header", cfg.replay_path);
+		return -EINVAL;
+	}
+
+	log_info("replay: %d cores at %d cycles per us from '%s'",
+		 sched_cores_nr, replay_cycles_per_us, cfg.replay_path);
+	return 0;
+}
+
+const struct sample_ops replay_sample_ops = {
+	.name		= "replay",
+	.init		= replay_sample_init,
+	.request	= replay_sample_request,
+	.gather		= replay_sample_gather,
+};
+
+/**
+ * record_open - starts recording gathered samples to a trace
+ * @path: the trace file to create
+ * @nr_sockets: the number of sockets with memory controllers
+ * @nr_channels: the number of memory channels per socket
+ *
+ * Returns 0 if successful.
+ */
+int record_open(const char *path, unsigned int nr_sockets,
+		unsigned int nr_channels)
+{
+	int i;
+
+	record_file = fopen(path, "w");
+	if (!record_file) {
+		log_err("record: could not create '%s' (%s)", path,
+			strerror(errno));
+		return -errno;
+	}
+
+	fprintf(record_file, "h %d %u %u\nt", cycles_per_us, nr_sockets,
+		nr_channels);
+	for (i = 0; i < sched_cores_nr; i++)
+		fprintf(record_file, " %u", sched_cores_tbl[i]);
+	fprintf(record_file, "\n");
+	return 0;
+}
+
+/**
+ * record_window - appends a gathered window to the trace
+ * @samples: the samples that were just gathered
+ */
+void record_window(struct pmc_sample *samples)
+{
+	struct ksched_pmc_sample *s;
+	int core, tmp;
+
+	if (!record_file)
+		return;
+
+	/* write out the previous window in one go */
+	fflush(record_file);
+	fprintf(record_file, "w %" PRIu64 "\n", rdtsc());
+	sched_for_each_allowed_core(core, tmp) {
+		s = &samples[core].pmc;
+		fprintf(record_file, "c %d %llu %llu %llu %llu %llu %llu %llu "
+			"%llu %llu %llu %u %u %llu\n", core, s->tsc, s->val[0],
+			s->val[1], s->val[2], s->val[3], s->fixed[0], s->fixed[1],
+			s->fixed[2], s->aperf, s->mperf, s->pid, s->tgid,
+			s->nr_switches);
+	}
+}
+
+/**
+ * record_cas - appends a memory channel's CAS counts to the current window
+ * @socket: the socket of the memory controller
+ * @channel: the channel on the memory controller
+ * @rd: the read CAS count
+ * @wr: the write CAS count
+ */
+void record_cas(unsigned int socket, unsigned int channel, uint64_t rd,
+		uint64_t wr)
+{
+	if (!record_file)
+		return;
+
+	fprintf(record_file, "m %u %u %" PRIu64 " %" PRIu64 "\n", socket,
+		channel, rd, wr);
+}
@@ -51,21 +51,21 @@ struct core_state {
 
 /* a per-CPU state table to manage scheduling operations */
 static struct core_state state[NCPU];
-/* policy-specific operations (TODO: should be made configurable) */
-const struct sched_ops *sched_ops;
 
 /* current hardware timestamp */
 static uint64_t cur_tsc;
 
 /**
  * sched_poll - advance the scheduler during each poll loop iteration
+ *
+ * Returns the TSC at which it next has work to do.
  */
-void sched_poll(void)
+uint64_t sched_poll(void)
 {
 	static uint64_t last_time;
 	DEFINE_BITMAP(idle, NCPU);
 	struct core_state *s;
-	uint64_t now;
+	uint64_t now, next;
 	int i, core, idle_cnt = 0;
 	struct proc *p, *p_next;
 
@@ -83,8 +83,10 @@ void sched_poll(void)
 	 * fast pass --- runs every poll loop
 	 */
 
-	ias_sched_poll(now);
+	next = ias_sched_poll(now);
 	ksched_send_intrs();
+
+	return start_tsc + next * cycles_per_us;
 }
 
 static int sched_scan_node(int node)
@@ -186,9 +188,16 @@ int sched_init(void)
 	else
 		sched_dp_core = sched_siblings[sched_ctrl_core];
 	bitmap_clear(sched_allowed_cores, sched_ctrl_core);
-	bitmap_clear(sched_allowed_cores, sched_dp_core);
-	log_info("sched: dataplane on %d, control on %d",
-		 sched_dp_core, sched_ctrl_core);
+	/* only a spinning main loop keeps its sibling from tenants */
+	if (cfg.wait == WAIT_SPIN) {
+		bitmap_clear(sched_allowed_cores, sched_dp_core);
+		log_info("sched: dataplane on %d, control on %d",
+			 sched_dp_core, sched_ctrl_core);
+	} else {
+		log_info("sched: control on %d", sched_ctrl_core);
+	}
+	/* the main loop stays there, off any core a policy idles */
+	pin_thread(0, sched_ctrl_core);
 
 	/* check if configuration disables hyperthreads */
 	if (NOHOT) {
@@ -43,7 +43,7 @@ extern int sched_cores_nr;
  * API for the rest of the IOkernel
  */
 
-extern void sched_poll(void);
+extern uint64_t sched_poll(void);
 // extern int sched_add_core(struct proc *p);
 // extern int sched_attach_proc(struct proc *p);
 // extern void sched_detach_proc(struct proc *p);
@@ -53,8 +53,11 @@ extern void sched_poll(void);
  * Scheduler policies
  */
 
-extern const struct sched_ops *sched_ops;
+/* loaded from a shared object at startup (see inc/counter/policy.h) */
+extern const struct counter_policy *sched_policy;
 
-extern void ias_sched_poll(uint64_t);
-extern void ias_bw_init(void);
+extern uint64_t now_us;
+extern uint64_t ias_interval_us;
+extern uint64_t ias_sched_poll(uint64_t);
+extern int ias_bw_init(void);
 extern int pin_thread(pid_t, int);
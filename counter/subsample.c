@@ -0,0 +1,293 @@
+/*
+ * subsample.c - samples a rotating subset of cores on large machines
+ *
+ * With 'subsample <k>', each window interrupts only k cores of every LLC
+ * domain, taking turns, plus every core flagged as hot. A core that is left
+ * out keeps its last sample, so the next time it is sampled its deltas span
+ * every window since. Its rates in the meantime are the last ones measured,
+ * and est_win.sampled tells them apart.
+ *
+ * Each LLC domain is split into two strata: the hot cores, which are all
+ * sampled, and the rest, whose total is extrapolated from the ones sampled
+ * this window. The totals are summed per socket, with a 95% confidence bound
+ * from the spread of the sampled rates.
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <base/stddef.h>
+#include <base/bitmap.h>
+#include <base/cpu.h>
+#include <base/log.h>
+#include <base/sysfs.h>
+
+#include "defs.h"
+#include "sched.h"
+#include "sample.h"
+#include "estimate.h"
+#include "subsample.h"
+
+#define SUB_LLC_PATH	"/sys/devices/system/cpu/cpu%d/cache/index3/shared_cpu_list"
+/* a core turns hot above this multiple of its domain's mean miss rate */
+#define SUB_HOT_FACTOR		2.0
+/* and cools down again below the mean */
+#define SUB_COOL_FACTOR		1.0
+/* ... unless its traffic is too small to matter either way (MB/s) */
+#define SUB_HOT_MIN_MBPS	100.0
+/* the z-score of a two-sided 95% confidence interval */
+#define SUB_Z_95		1.96
+
+/* the cores to sample this window (all allowed cores without subsampling) */
+DEFINE_BITMAP(sample_cores, NCPU);
+
+struct sub_socket sub_sockets[NNUMA];
+unsigned int sub_nr_sockets;
+
+/* the cores sharing one last-level cache */
+struct sub_domain {
+	unsigned int	start;	/* the first core's position in sub_order */
+	unsigned int	nr;
+	unsigned int	cursor;	/* where the next turn starts among the cold */
+	unsigned int	socket;
+};
+
+static struct sub_domain sub_domains[NCPU];
+static unsigned int sub_nr_domains;
+/* the sampled cores' indices in sched_cores_tbl, grouped by domain */
+static unsigned int sub_order[NCPU];
+static bool sub_hot[NCPU];
+
+/* the last rates measured on each core, for the windows it sits out */
+static struct {
+	float	miss_rate[NCPU];
+	float	busy_miss_rate[NCPU];
+	float	busy[NCPU];
+	float	rate[NCPU];
+	float	miss_ratio[NCPU];
+	float	mpki[NCPU];
+	float	ipc[NCPU];
+	float	l2_miss_rate[NCPU];
+} sub_last;
+
+/* the lowest CPU sharing a core's LLC, or of its socket if unknown */
+static int sub_llc_id(int core)
+{
+	DEFINE_BITMAP(cpus, NCPU);
+	char path[PATH_MAX];
+	int i;
+
+	snprintf(path, sizeof(path), SUB_LLC_PATH, core);
+	if (!sysfs_parse_bitlist(path, cpus, NCPU))
+		return bitmap_find_next_set(cpus, NCPU, 0);
+
+	for (i = 0; i < core; i++) {
+		if (cpu_info_tbl[i].package == cpu_info_tbl[core].package)
+			break;
+	}
+	return i;
+}
+
+/**
+ * subsample_init - groups the sampled cores by LLC domain
+ *
+ * Returns 0 if successful.
+ */
+int subsample_init(void)
+{
+	int llc[NCPU], i, j, n = 0;
+	struct sub_domain *d;
+
+	bitmap_init(sample_cores, NCPU, false);
+	for (i = 0; i < sched_cores_nr; i++)
+		bitmap_set(sample_cores, sched_cores_tbl[i]);
+
+	for (i = 0; i < sched_cores_nr; i++)
+		llc[i] = sub_llc_id(sched_cores_tbl[i]);
+
+	/* group the cores, keeping each domain in sched_cores_tbl order */
+	for (i = 0; i < sched_cores_nr; i++) {
+		for (j = 0; j < i; j++) {
+			if (llc[j] == llc[i])
+				break;
+		}
+		if (j < i)
+			continue;
+
+		d = &sub_domains[sub_nr_domains++];
+		d->start = n;
+		d->socket = MIN(cpu_info_tbl[sched_cores_tbl[i]].package,
+				NNUMA - 1);
+		sub_nr_sockets = MAX(sub_nr_sockets, d->socket + 1);
+		for (j = i; j < sched_cores_nr; j++) {
+			if (llc[j] == llc[i])
+				sub_order[n++] = j;
+		}
+		d->nr = n - d->start;
+	}
+
+	if (!cfg.ias_subsample)
+		return 0;
+	if (cfg.ias_sample == IAS_SAMPLE_TIMER) {
+		log_warn("subsample: the kernel timers sample every core anyway");
+		cfg.ias_subsample = 0;
+		return 0;
+	}
+
+	log_info("subsample: sampling %u cores per window in each of %u LLC "
+		 "domains", cfg.ias_subsample, sub_nr_domains);
+	return 0;
+}
+
+/**
+ * subsample_select - picks the cores to sample in the next window
+ */
+void subsample_select(void)
+{
+	unsigned int cold[NCPU], i, k, nr;
+	struct sub_domain *d;
+	int idx;
+
+	if (!cfg.ias_subsample)
+		return;
+
+	bitmap_init(sample_cores, NCPU, false);
+	for (d = sub_domains; d < sub_domains + sub_nr_domains; d++) {
+		nr = 0;
+		for (i = d->start; i < d->start + d->nr; i++) {
+			idx = sub_order[i];
+			if (sub_hot[idx])
+				bitmap_set(sample_cores, sched_cores_tbl[idx]);
+			else
+				cold[nr++] = idx;
+		}
+		if (!nr)
+			continue;
+
+		k = MIN(cfg.ias_subsample, nr);
+		for (i = 0; i < k; i++)
+			bitmap_set(sample_cores,
+				   sched_cores_tbl[cold[(d->cursor + i) % nr]]);
+		d->cursor = (d->cursor + k) % nr;
+	}
+}
+
+/* fills in the rates of the cores that sat out with their last ones */
+static void sub_carry(void)
+{
+	struct est_window *w = &est_win;
+	int i;
+
+	for (i = 0; i < sched_cores_nr; i++) {
+		w->sampled[i] = bitmap_test(sample_cores, sched_cores_tbl[i]);
+		if (w->sampled[i]) {
+			sub_last.miss_rate[i] = w->miss_rate[i];
+			sub_last.busy_miss_rate[i] = w->busy_miss_rate[i];
+			sub_last.busy[i] = w->busy[i];
+			sub_last.rate[i] = w->rate[i];
+			sub_last.miss_ratio[i] = w->miss_ratio[i];
+			sub_last.mpki[i] = w->mpki[i];
+			sub_last.ipc[i] = w->ipc[i];
+			sub_last.l2_miss_rate[i] = w->l2_miss_rate[i];
+		} else {
+			w->miss_rate[i] = sub_last.miss_rate[i];
+			w->busy_miss_rate[i] = sub_last.busy_miss_rate[i];
+			w->busy[i] = sub_last.busy[i];
+			w->rate[i] = sub_last.rate[i];
+			w->miss_ratio[i] = sub_last.miss_ratio[i];
+			w->mpki[i] = sub_last.mpki[i];
+			w->ipc[i] = sub_last.ipc[i];
+			w->l2_miss_rate[i] = sub_last.l2_miss_rate[i];
+		}
+	}
+}
+
+/* flags the cores whose misses stand out in their domain */
+static void sub_flag_hot(struct sub_domain *d, float mean, float multiplier)
+{
+	unsigned int i;
+	float rate;
+	int idx;
+
+	for (i = d->start; i < d->start + d->nr; i++) {
+		idx = sub_order[i];
+		if (!est_win.sampled[idx])
+			continue;
+		rate = est_win.miss_rate[idx];
+		if (!sub_hot[idx] && rate > mean * SUB_HOT_FACTOR &&
+		    rate * multiplier > SUB_HOT_MIN_MBPS)
+			sub_hot[idx] = true;
+		else if (sub_hot[idx] && (rate < mean * SUB_COOL_FACTOR ||
+					  rate * multiplier < SUB_HOT_MIN_MBPS))
+			sub_hot[idx] = false;
+	}
+}
+
+/*
+ * Extrapolates a domain's total miss rate into @total and counts its sampled
+ * cores into @sampled. Returns the variance of the total.
+ */
+static float sub_estimate(struct sub_domain *d, float *total,
+			  unsigned int *sampled)
+{
+	float sum = 0.0, sum_sq = 0.0, hot = 0.0, rate, mean = 0.0, var = 0.0;
+	unsigned int i, n = 0, nr_cold = 0;
+	int idx;
+
+	for (i = d->start; i < d->start + d->nr; i++) {
+		idx = sub_order[i];
+		rate = est_win.miss_rate[idx];
+		if (sub_hot[idx]) {
+			hot += rate;
+			(*sampled)++;
+			continue;
+		}
+		nr_cold++;
+		if (!est_win.sampled[idx])
+			continue;
+		sum += rate;
+		sum_sq += rate * rate;
+		n++;
+		(*sampled)++;
+	}
+
+	/* the expansion estimator, with the finite population correction */
+	if (n)
+		mean = sum / n;
+	if (n > 1) {
+		var = MAX((sum_sq - sum * mean) / (n - 1), 0.0);
+		var *= (float)nr_cold * nr_cold / n * (1.0 - (float)n / nr_cold);
+	}
+
+	*total = hot + mean * nr_cold;
+	return var;
+}
+
+/**
+ * subsample_window - completes est_win and the per-socket estimates
+ * @multiplier: converts a miss rate to MB/s
+ *
+ * Must be called after est_compute(), before the next subsample_select().
+ */
+void subsample_window(float multiplier)
+{
+	float var[NNUMA] = {0}, total;
+	struct sub_socket *s;
+	struct sub_domain *d;
+
+	sub_carry();
+
+	memset(sub_sockets, 0, sizeof(sub_sockets));
+	for (d = sub_domains; d < sub_domains + sub_nr_domains; d++) {
+		s = &sub_sockets[d->socket];
+		var[d->socket] += sub_estimate(d, &total, &s->nr_sampled);
+		s->llc_mbps += total * multiplier;
+		s->nr_cores += d->nr;
+		sub_flag_hot(d, total / d->nr, multiplier);
+	}
+	for (s = sub_sockets; s < sub_sockets + sub_nr_sockets; s++)
+		s->llc_mbps_ci = SUB_Z_95 * sqrtf(var[s - sub_sockets]) *
+				 multiplier;
+}
@@ -0,0 +1,24 @@
+/*
+ * subsample.h - samples a rotating subset of cores on large machines
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <base/limits.h>
+
+/* one socket's LLC miss traffic, extrapolated from the sampled cores */
+struct sub_socket {
+	float		llc_mbps;	/* the estimated total */
+	float		llc_mbps_ci;	/* the 95% confidence half-width */
+	unsigned int	nr_sampled;
+	unsigned int	nr_cores;
+};
+
+extern struct sub_socket sub_sockets[NNUMA];
+extern unsigned int sub_nr_sockets;
+
+extern int subsample_init(void);
+extern void subsample_select(void);
+extern void subsample_window(float multiplier);
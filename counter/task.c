@@ -0,0 +1,185 @@
+/*
+ * task.c - attributes LLC misses to the processes that caused them
+ *
+ * Each sample carries the task that was running when it was taken. A core's
+ * window is credited to a process only if the same task was running at both
+ * ends and never switched out in between; other windows can't be split
+ * without knowing when the switch happened, so they are discarded.
+ *
+ * Processes are kept in an open-addressing hash table keyed by TGID. Entries
+ * are stamped with the window they belong to, so starting a new window
+ * never has to clear the table.
+ *
+ * When ksched is loaded with tasks=1, it accumulates exact per-process totals
+ * at every context switch instead; task_exact_poll() reports those. A slot
+ * of that table is reused some time after its process exits, so each slot's
+ * generation is checked before its totals are compared with the last ones.
+ */
+
+#include <inttypes.h>
+
+#include <base/stddef.h>
+#include <base/hash.h>
+#include <base/log.h>
+
+#include "defs.h"
+#include "sched.h"
+#include "ksched.h"
+#include "task.h"
+#include "cgroup.h"
+
+/* the most processes tracked per window (must be a power of two) */
+#define TASK_TBL_SIZE		4096
+#define TASK_TBL_MASK		(TASK_TBL_SIZE - 1)
+
+static struct task_stats task_tbl[TASK_TBL_SIZE];
+static uint32_t task_gen;
+
+/* the processes seen in the current window */
+struct task_stats *task_list[TASK_TBL_SIZE];
+unsigned int task_nr;
+/* core windows that were discarded because the running task changed */
+uint64_t task_mixed_windows;
+
+static struct task_stats *task_lookup(uint32_t tgid)
+{
+	struct task_stats *t;
+	uint32_t idx, i;
+
+	idx = hash_crc32c_one(0, tgid) & TASK_TBL_MASK;
+	for (i = 0; i < TASK_TBL_SIZE; i++) {
+		t = &task_tbl[(idx + i) & TASK_TBL_MASK];
+		if (t->gen != task_gen) {
+			t->tgid = tgid;
+			t->gen = task_gen;
+			t->nr_cores = 0;
+			t->misses = 0;
+			t->instrs = 0;
+			t->miss_rate = 0.0;
+			task_list[task_nr++] = t;
+			return t;
+		}
+		if (t->tgid == tgid)
+			return t;
+	}
+
+	return NULL;
+}
+
+/**
+ * task_begin_window - forgets the processes of the previous window
+ */
+void task_begin_window(void)
+{
+	/* zero marks entries that were never used */
+	if (++task_gen == 0)
+		task_gen = 1;
+	task_nr = 0;
+}
+
+/**
+ * task_account - credits a core's window to the process that ran in it
+ * @s: the sample at the start of the window
+ * @e: the sample at the end of the window
+ * @misses: the LLC misses on the core in the window
+ * @instrs: the instructions retired on the core in the window
+ * @miss_rate: the LLC misses per TSC cycle on the core in the window
+ *
+ * Returns the process's entry, or NULL if the window was discarded.
+ */
+struct task_stats *task_account(const struct ksched_pmc_sample *s,
+				const struct ksched_pmc_sample *e,
+				uint64_t misses, uint64_t instrs,
+				float miss_rate)
+{
+	struct task_stats *t;
+
+	if (s->pid != e->pid || s->tgid != e->tgid ||
+	    s->nr_switches != e->nr_switches) {
+		task_mixed_windows++;
+		return NULL;
+	}
+
+	t = task_lookup(e->tgid);
+	if (unlikely(!t)) {
+		log_warn_once("task: too many processes in one window");
+		return NULL;
+	}
+
+	t->nr_cores++;
+	t->misses += misses;
+	t->instrs += instrs;
+	t->miss_rate += miss_rate;
+	return t;
+}
+
+/* the totals of each ksched table slot at the previous poll */
+static uint64_t task_exact_last[KSCHED_TASK_TBL_SIZE];
+static uint64_t task_exact_last_instrs[KSCHED_TASK_TBL_SIZE];
+static uint32_t task_exact_gen[KSCHED_TASK_TBL_SIZE];
+static uint64_t task_exact_last_us;
+/* context switches ksched could not credit, as of the previous poll */
+static uint64_t task_exact_dropped;
+
+/**
+ * task_exact_poll - logs the exact bandwidth of each process since last poll
+ * @pmc: the index of the LLC miss counter in the sampled group
+ *
+ * Each process is also added to its cgroup's rollup.
+ *
+ * Returns false if ksched keeps no per-process table.
+ */
+bool task_exact_poll(unsigned int pmc)
+{
+	struct ksched_task_stat *t;
+	uint64_t misses, instrs, delta, delta_instrs, window_us, dropped;
+	uint32_t tgid, gen;
+	float mbps;
+	int i;
+
+	if (!ksched_tasks)
+		return false;
+
+	dropped = ACCESS_ONCE(ksched_tasks->dropped);
+	if (dropped != task_exact_dropped)
+		log_warn("NOW: %" PRIu64 " | task: %" PRIu64 " context switches "
+			 "not credited (process table full)", now_us,
+			 dropped - task_exact_dropped);
+	task_exact_dropped = dropped;
+
+	window_us = now_us - task_exact_last_us;
+	for (i = 0; i < KSCHED_TASK_TBL_SIZE; i++) {
+		t = &ksched_tasks->tasks[i];
+		gen = load_acquire(&t->gen);
+		tgid = ACCESS_ONCE(t->tgid);
+		if (!tgid || tgid == KSCHED_TASK_CLAIMING || (gen & 1))
+			continue;
+
+		misses = ACCESS_ONCE(t->val[pmc]);
+		instrs = ACCESS_ONCE(t->fixed[KSCHED_FIXED_INSTR_RETIRED]);
+		rmb();
+		if (ACCESS_ONCE(t->gen) != gen)
+			continue;
+
+		/* a reused slot counts from zero for its new process */
+		if (gen != task_exact_gen[i]) {
+			task_exact_gen[i] = gen;
+			task_exact_last[i] = 0;
+			task_exact_last_instrs[i] = 0;
+		}
+		delta = misses - task_exact_last[i];
+		delta_instrs = instrs - task_exact_last_instrs[i];
+		task_exact_last[i] = misses;
+		task_exact_last_instrs[i] = instrs;
+		if (!task_exact_last_us || !delta || !window_us)
+			continue;
+
+		mbps = (float)delta * CACHE_LINE_SIZE / (float)window_us;
+		cg_account(tgid, delta, delta_instrs, mbps);
+		log_info("NOW: %" PRIu64 " | Process %u - %.1f MB/s (exact)",
+			 now_us, tgid, mbps);
+	}
+
+	task_exact_last_us = now_us;
+	return true;
+}
@@ -0,0 +1,30 @@
+/*
+ * task.h - attributes LLC misses to the processes that caused them
+ */
+
+#pragma once
+
+#include <base/stddef.h>
+
+#include "sample.h"
+
+/* one process's share of a window */
+struct task_stats {
+	uint32_t	tgid;
+	uint32_t	gen;		/* the window this entry belongs to */
+	unsigned int	nr_cores;	/* cores it ran on for the whole window */
+	uint64_t	misses;
+	uint64_t	instrs;
+	float		miss_rate;	/* LLC misses per TSC cycle (all cores) */
+};
+
+extern struct task_stats *task_list[];
+extern unsigned int task_nr;
+extern uint64_t task_mixed_windows;
+
+extern void task_begin_window(void);
+extern struct task_stats *task_account(const struct ksched_pmc_sample *s,
+				       const struct ksched_pmc_sample *e,
+				       uint64_t misses, uint64_t instrs,
+				       float miss_rate);
+extern bool task_exact_poll(unsigned int pmc);
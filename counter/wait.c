@@ -0,0 +1,197 @@
+/*
+ * wait.c - waits for the main loop's next deadline
+ *
+ * counterd only has work at window boundaries. 'wait' picks how its main loop
+ * waits for the next one:
+ *
+ * - spin polls the TSC, for the least latency.
+ * - tpause parks the hyperthread in C0.2 until the deadline, so its sibling
+ *   gets the core's resources. counterd still holds the CPU.
+ * - sleep frees the CPU with clock_nanosleep(). The kernel wakes it a
+ *   varying amount late, so the sleep ends early by the recent worst delay
+ *   and the rest is spun out on the TSC.
+ *
+ * Every wait records how late it returned past its deadline.
+ *
+ * wait_park() lends the tpause wait to other threads that only hold a core
+ * (the hyperthread idlers), without the bookkeeping.
+ */
+
+#include <errno.h>
+#include <time.h>
+#include <immintrin.h>
+#include <sys/prctl.h>
+
+#include <base/stddef.h>
+#include <base/log.h>
+#include <base/time.h>
+
+#include "defs.h"
+#include "wait.h"
+
+/* the slack a sleep starts with, and the most it ends early by (us) */
+#define WAIT_INIT_SLACK_US	50
+#define WAIT_MAX_SLACK_US	500
+/* tpause's deeper power state, C0.2 (C0.1 is 1) */
+#define WAIT_TPAUSE_C02		0
+/* CPUID.(EAX=7,ECX=0):ECX bit for tpause, umonitor and umwait */
+#define WAIT_CPUID_WAITPKG	(1U << 5)
+
+static const char *wait_names[] = {
+	[WAIT_SPIN]	= "spin",
+	[WAIT_TPAUSE]	= "tpause",
+	[WAIT_SLEEP]	= "sleep",
+};
+
+/* whether the CPU has tpause (checked by wait_init()) */
+static bool wait_waitpkg;
+
+/* how much earlier than the deadline a sleep ends (cycles) */
+static uint64_t wait_slack;
+
+/* how late waits returned since the last wait_stats() (cycles) */
+static uint64_t wait_late, wait_late_max;
+static unsigned int wait_nr;
+
+static void wait_spin(uint64_t deadline)
+{
+	while (rdtsc() < deadline)
+		cpu_relax();
+}
+
+__attribute__((target("waitpkg")))
+static void wait_tpause(uint64_t deadline)
+{
+	/* the kernel caps each pause (IA32_UMWAIT_CONTROL), so repeat it */
+	while (rdtsc() < deadline)
+		_tpause(WAIT_TPAUSE_C02, deadline);
+}
+
+static void wait_sleep(uint64_t deadline)
+{
+	struct timespec ts;
+	uint64_t now, wake, delay, ns;
+
+	now = rdtsc();
+	if (deadline - now > wait_slack) {
+		/* map the TSC to CLOCK_MONOTONIC afresh, so errors don't add up */
+		wake = deadline - wait_slack;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ns = (wake - now) * 1000 / cycles_per_us + ts.tv_nsec;
+		ts.tv_sec += ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		/* a signal may have asked counterd to stop */
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+			return;
+
+		/* follow a longer delay at once and a shorter one slowly */
+		now = rdtsc();
+		delay = now > wake ? now - wake : 0;
+		if (delay > wait_slack)
+			wait_slack = delay;
+		else
+			wait_slack -= (wait_slack - delay) / 16;
+		wait_slack = MIN(wait_slack,
+				 (uint64_t)WAIT_MAX_SLACK_US * cycles_per_us);
+	}
+
+	wait_spin(deadline);
+}
+
+/**
+ * wait_until - waits for a deadline in the way chosen by cfg.wait
+ * @deadline: the TSC to wait for
+ *
+ * Returns at once if the deadline already passed, and may return early
+ * when a signal interrupts a sleep.
+ */
+void wait_until(uint64_t deadline)
+{
+	uint64_t now, late;
+
+	if (rdtsc() >= deadline)
+		return;
+
+	switch (cfg.wait) {
+	case WAIT_TPAUSE:
+		wait_tpause(deadline);
+		break;
+	case WAIT_SLEEP:
+		wait_sleep(deadline);
+		break;
+	default:
+		wait_spin(deadline);
+	}
+
+	/* a sleep cut short by a signal */
+	now = rdtsc();
+	if (now < deadline)
+		return;
+	late = now - deadline;
+	wait_late += late;
+	wait_late_max = MAX(wait_late_max, late);
+	wait_nr++;
+}
+
+/**
+ * wait_park - keeps the calling hyperthread out of its sibling's way
+ * @deadline: the TSC to return at
+ *
+ * Parks in C0.2 with tpause if the CPU has it, otherwise spins on pause.
+ */
+void wait_park(uint64_t deadline)
+{
+	if (wait_waitpkg)
+		wait_tpause(deadline);
+	else
+		wait_spin(deadline);
+}
+
+/**
+ * wait_stats - reports how late waits returned, then starts over
+ * @s: filled with the lateness since the last call
+ */
+void wait_stats(struct wait_stats *s)
+{
+	s->nr_waits = wait_nr;
+	s->late_us = wait_nr ? (float)wait_late / wait_nr / cycles_per_us : 0.0;
+	s->late_max_us = (float)wait_late_max / cycles_per_us;
+	wait_late = 0;
+	wait_late_max = 0;
+	wait_nr = 0;
+}
+
+/**
+ * wait_mode_name - gets the name of the wait mode in use
+ */
+const char *wait_mode_name(void)
+{
+	return wait_names[cfg.wait];
+}
+
+/**
+ * wait_init - checks that the chosen wait mode can be used
+ *
+ * Falls back to sleeping if the CPU can't tpause. Returns 0.
+ */
+int wait_init(void)
+{
+	struct cpuid_info regs;
+
+	cpuid(7, 0, &regs);
+	wait_waitpkg = regs.ecx & WAIT_CPUID_WAITPKG;
+	if (cfg.wait == WAIT_TPAUSE && !wait_waitpkg) {
+		log_warn("wait: this CPU can't tpause, sleeping instead");
+		cfg.wait = WAIT_SLEEP;
+	}
+
+	if (cfg.wait == WAIT_SLEEP) {
+		/* otherwise the kernel may defer every wakeup by 50 us */
+		if (prctl(PR_SET_TIMERSLACK, 1UL))
+			log_warn("wait: could not lower the timer slack");
+		wait_slack = (uint64_t)WAIT_INIT_SLACK_US * cycles_per_us;
+	}
+
+	log_info("wait: %s between deadlines", wait_mode_name());
+	return 0;
+}
@@ -0,0 +1,20 @@
+/*
+ * wait.h - waits for the main loop's next deadline
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* how late the main loop woke up, since the last call to wait_stats() */
+struct wait_stats {
+	float		late_us;	/* on average */
+	float		late_max_us;
+	unsigned int	nr_waits;
+};
+
+extern const char *wait_mode_name(void);
+extern int wait_init(void);
+extern void wait_until(uint64_t deadline);
+extern void wait_park(uint64_t deadline);
+extern void wait_stats(struct wait_stats *s);
@@ -0,0 +1,88 @@
+/*
+ * policy.h - the interface for scheduling policies loaded into counterd
+ *
+ * A policy is a shared object that exports a struct counter_policy named
+ * COUNTER_POLICY_SYM. counterd loads it at startup ('policy <lib.so>'),
+ * calls init() once, then window() after every sampling window. A window's
+ * statistics are passed as arrays, one per field, so a policy can scan a
+ * field across all cores without striding over the others. The arrays are
+ * only valid during the call.
+ *
+ * Policies act through the table handed to init() rather than on their own,
+ * so the same policy runs unchanged against a replayed trace, where every
+ * action is only logged.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* bumped whenever a structure below changes incompatibly */
+#define COUNTER_POLICY_ABI	3
+/* the symbol counterd looks up in a policy's shared object */
+#define COUNTER_POLICY_SYM	"counter_policy"
+
+/* the statistics of one sampling window */
+struct counter_policy_window {
+	uint64_t	now_us;
+	uint32_t	nr_cores;
+	uint32_t	nr_sockets;
+
+	/* per core, indexed 0 .. nr_cores - 1 */
+	const uint32_t	*core;		/* the CPU number */
+	const uint32_t	*socket;	/* the CPU's socket */
+	const uint32_t	*tgid;		/* the process that ran all window, or 0 */
+	const uint64_t	*llc_misses;
+	const uint64_t	*llc_refs;
+	const uint64_t	*instrs;
+	const uint64_t	*cycles;
+	const float	*miss_rate;	/* LLC misses per TSC cycle */
+	const float	*busy;		/* fraction of the window unhalted */
+	const float	*mpki;
+	const float	*ipc;
+	const int32_t	*sibling;	/* the SMT sibling's index, or -1 */
+	const uint8_t	*sampled;	/* 0 if these are the last measured */
+
+	/* per socket, indexed 0 .. nr_sockets - 1 */
+	const float	*bw_rd_mbps;
+	const float	*bw_wr_mbps;
+	const float	*bw_mbps;
+	const float	*llc_mbps;	/* LLC miss traffic (extrapolated) */
+	const float	*llc_mbps_ci;	/* ... its 95% confidence half-width */
+};
+
+/* the actions a policy may take, each returns 0 or a negative errno */
+struct counter_policy_actions {
+	/*
+	 * restricts a thread to a core; given a tgid, all of the process's
+	 * current threads (and so the ones they create later)
+	 */
+	int (*pin)(pid_t tid, unsigned int core);
+	/* limits a cgroup (relative to the cgroup2 root) to a CPU quota */
+	int (*throttle)(const char *cgroup, uint64_t quota_us,
+			uint64_t period_us);
+	/* lifts a cgroup's CPU quota */
+	int (*unthrottle)(const char *cgroup);
+	/* sets a resctrl group's L3 ways and memory bandwidth (%) on a socket */
+	int (*resctrl)(const char *group, unsigned int socket,
+		       uint64_t l3_mask, unsigned int mba_percent);
+	/*
+	 * keeps a core idle for up to one window (e.g. to stop it from
+	 * starving its sibling); ask again every window to keep it idle
+	 */
+	int (*idle)(unsigned int core, uint64_t us);
+};
+
+struct counter_policy {
+	uint32_t	abi;		/* must be COUNTER_POLICY_ABI */
+	const char	*name;
+
+	/* called once at startup with the policy's argument string, or NULL */
+	int	(*init)(const struct counter_policy_actions *act,
+			const char *args);
+	/* called after every window, on counterd's polling core */
+	void	(*window)(const struct counter_policy_window *w);
+	/* called at exit, optional */
+	void	(*exit)(void);
+};
@@ -0,0 +1,210 @@
+/*
+ * shm.h - the shared memory ring that counterd publishes windows into
+ *
+ * counterd is the only writer. Any number of consumers may attach the ring
+ * read-only and follow @seq: without privilege through counter_shm_attach(),
+ * which receives a sealed memfd over COUNTER_SOCK_PATH, or with
+ * mem_map_shm_rdonly(COUNTER_SHM_KEY, ...) when counterd runs with 'publish
+ * sysv'. Windows are read in place, then validated with counter_shm_valid(),
+ * because the writer never waits for consumers and may lap a slow one.
+ */
+
+#pragma once
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <base/atomic.h>
+#include <base/limits.h>
+#include <base/mem.h>
+#include <base/stddef.h>
+
+#define COUNTER_SHM_KEY		0x636e7472 /* "cntr" */
+#define COUNTER_SHM_MAGIC	0x434e5452
+#define COUNTER_SHM_VERSION	8
+/* The abstract namespace path for the socket that hands out the ring. */
+#define COUNTER_SOCK_PATH	"\0/control/counterd.sock"
+/* the number of windows kept (must be a power of two) */
+#define COUNTER_SHM_RING_SIZE	64
+/* the most cgroups reported per window */
+#define COUNTER_SHM_MAX_CGROUPS	64
+
+/* one core's counters over a window */
+struct counter_shm_core {
+	uint32_t	core;
+	uint32_t	tgid;		/* the process that ran all window, or 0 */
+	uint64_t	tsc_start;	/* TSC at the start of the window */
+	uint64_t	tsc_end;	/* TSC at the end of the window */
+
+	/* raw counter deltas */
+	uint64_t	llc_misses;
+	uint64_t	llc_refs;
+	uint64_t	instrs;
+	uint64_t	cycles;
+	uint64_t	busy_cycles;	/* the cycles used to normalize rates */
+
+	/* derived rates */
+	float		miss_rate;	/* LLC misses per TSC cycle */
+	float		busy_miss_rate;	/* LLC misses per busy cycle */
+	float		busy;		/* fraction of the window busy */
+	float		miss_ratio;	/* LLC misses per LLC reference */
+	float		mpki;		/* LLC misses per 1000 instructions */
+	float		ipc;
+
+	/* with 'ht': the hyperthread sibling (NCPU if none was sampled) */
+	uint32_t	sibling;
+	float		pair_miss_rate;	/* both siblings' misses per TSC cycle */
+
+	/* with 'subsample': 0 if the rates are the last measured ones */
+	uint32_t	sampled;
+} __aligned(CACHE_LINE_SIZE);
+
+/* one cgroup's processes over a window */
+struct counter_shm_cgroup {
+	uint64_t	id;		/* the cgroup directory's inode */
+	uint64_t	misses;		/* LLC misses */
+	uint64_t	instrs;
+	uint64_t	bytes;		/* estimated DRAM traffic */
+	float		mbps;
+	uint32_t	nr_procs;
+	uint64_t	llc_occupancy;	/* bytes of LLC held (RDT), or 0 */
+	float		mbm_total_mbps;	/* measured memory bandwidth (RDT) */
+	float		mbm_local_mbps;	/* ... of which to the local socket */
+	char		path[72];	/* truncated, relative to the root */
+} __aligned(CACHE_LINE_SIZE);
+
+/* one sampling window */
+struct counter_shm_window {
+	uint64_t	seq;		/* the window number, 0 while written */
+	uint64_t	now_us;		/* counterd's clock at the window end */
+	uint32_t	nr_cores;	/* valid entries in @cores */
+	uint32_t	nr_sockets;	/* valid entries in @bw_mbps */
+	uint32_t	nr_cgroups;	/* valid entries in @cgroups */
+	float		bw_mbps[NNUMA];	/* memory bandwidth per socket */
+	float		bw_rd_mbps[NNUMA]; /* ... of which reads */
+	float		bw_wr_mbps[NNUMA]; /* ... of which writes */
+	float		llc_mbps[NNUMA]; /* LLC miss traffic per socket */
+	float		llc_mbps_ci[NNUMA]; /* ... 95% bound, if subsampled */
+	uint32_t	wait_mode;	/* 0 spin, 1 tpause, 2 sleep */
+	float		wake_late_us;	/* how late counterd woke, on average */
+	float		wake_late_max_us; /* ... and at most */
+	struct counter_shm_core cores[NCPU];
+	struct counter_shm_cgroup cgroups[COUNTER_SHM_MAX_CGROUPS];
+} __aligned(CACHE_LINE_SIZE);
+
+struct counter_shm {
+	/* written once before @magic is published */
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	ring_size;
+	uint32_t	window_size;	/* sizeof(struct counter_shm_window) */
+	uint32_t	cycles_per_us;
+	uint32_t	pad;
+
+	/* the number of the last window published (0 if none yet) */
+	uint64_t	seq __aligned(CACHE_LINE_SIZE);
+
+	struct counter_shm_window ring[COUNTER_SHM_RING_SIZE];
+};
+
+#define COUNTER_SHM_SIZE \
+	align_up(sizeof(struct counter_shm), PGSIZE_2MB)
+
+/**
+ * counter_shm_latest - gets the number of the last window published
+ * @shm: the shared memory segment
+ *
+ * Returns the window number, or 0 if no window was published yet.
+ */
+static inline uint64_t counter_shm_latest(struct counter_shm *shm)
+{
+	return load_acquire(&shm->seq);
+}
+
+/**
+ * counter_shm_window - gets the ring slot that holds a window
+ * @shm: the shared memory segment
+ * @seq: the window number
+ *
+ * The slot must be checked with counter_shm_valid() before and after it is
+ * read.
+ */
+static inline struct counter_shm_window *
+counter_shm_window(struct counter_shm *shm, uint64_t seq)
+{
+	return &shm->ring[seq & (COUNTER_SHM_RING_SIZE - 1)];
+}
+
+/**
+ * counter_shm_valid - checks that a window was not overwritten while read
+ * @w: the ring slot returned by counter_shm_window()
+ * @seq: the window number
+ *
+ * Returns true if everything read from @w so far belongs to window @seq.
+ */
+static inline bool counter_shm_valid(struct counter_shm_window *w,
+				     uint64_t seq)
+{
+	rmb();
+	return ACCESS_ONCE(w->seq) == seq;
+}
+
+/**
+ * counter_shm_attach - maps the ring that counterd hands out
+ *
+ * Needs no privilege. counterd sends the ring's length and a memfd that is
+ * sealed against writes, so the mapping can only be read.
+ *
+ * Returns the mapping, or MAP_FAILED on failure.
+ */
+static inline struct counter_shm *counter_shm_attach(void)
+{
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char buf[CMSG_SPACE(sizeof(int))];
+	uint64_t len;
+	void *shm;
+	int sock, fd;
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return MAP_FAILED;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, COUNTER_SOCK_PATH, sizeof(COUNTER_SOCK_PATH) - 1);
+	if (connect(sock, (struct sockaddr *)&addr,
+		    offsetof(struct sockaddr_un, sun_path) +
+		    sizeof(COUNTER_SOCK_PATH) - 1)) {
+		close(sock);
+		return MAP_FAILED;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = buf;
+	msg.msg_controllen = sizeof(buf);
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(len)) {
+		close(sock);
+		return MAP_FAILED;
+	}
+	close(sock);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS)
+		return MAP_FAILED;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+	shm = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return shm;
+}
@@ -1,18 +1,47 @@
 #pragma once
 
 #include <asm/local.h>
+#include <linux/hrtimer.h>
+#include <linux/perf_event.h>
 
 #include "ksched.h"
 // #include "uintr_hw.h"
 
+/* a kernel counter's last raw reading, and its total scaled for multiplexing */
+struct ksched_perf_ctr {
+	u64			val;
+	u64			enabled;
+	u64			running;
+	u64			total;
+};
+
 struct ksched_percpu {
 	unsigned int		last_gen;
 	local_t			busy;
-	u64			last_sel;
+	u64			last_sel[KSCHED_NR_PMC];
 	struct task_struct	*running_task;
+	struct hrtimer		timer;
+	ktime_t			period;
+	struct ksched_pmc_sample sample;
+
+	/* the counters at the last context switch (tasks parameter) */
+	unsigned int		pmc_gen; /* bumped when the counters change */
+	unsigned int		switch_gen;
+	bool			switch_valid;
+	struct ksched_pmc_sample switch_last;
+
+	/* kernel counters (only used when the perf parameter is set) */
+	bool			perf_on;
+	unsigned int		perf_nr;
+	struct perf_event	*perf_pmc[KSCHED_NR_PMC];
+	struct perf_event	*perf_fixed[KSCHED_NR_FIXED];
+	struct ksched_perf_ctr	perf_pmc_ctr[KSCHED_NR_PMC];
+	struct ksched_perf_ctr	perf_fixed_ctr[KSCHED_NR_FIXED];
 
 	// struct uintr_percpu	uintr;
 };
 
 extern __read_mostly struct ksched_shm_cpu *shm;
+extern __read_mostly struct ksched_ring *rings;
+extern __read_mostly struct ksched_task_tbl *tasks;
 DECLARE_PER_CPU(struct ksched_percpu, kp);
\ No newline at end of file
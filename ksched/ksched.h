@@ -14,6 +14,17 @@
 #define KSCHED_MAJOR		280
 #define KSCHED_MINOR		0
 
+/* the maximum number of general-purpose counters sampled per request */
+#define KSCHED_NR_PMC		4
+
+/* the fixed-function counters read along with each request */
+enum {
+	KSCHED_FIXED_INSTR_RETIRED = 0,
+	KSCHED_FIXED_CORE_CYCLES,
+	KSCHED_FIXED_REF_CYCLES,
+	KSCHED_NR_FIXED,
+};
+
 struct ksched_intr_req {
 	size_t			len;
 	const void __user	*mask;
@@ -33,6 +44,20 @@ struct uintr_upid {
 	__u64 puir;		/* Posted user interrupt requests */
 } __aligned(64);
 
+/* a snapshot of the counters on one core */
+struct ksched_pmc_sample {
+	__u64			tsc;
+	__u64			val[KSCHED_NR_PMC];
+	__u64			fixed[KSCHED_NR_FIXED];
+	__u64			aperf;
+	__u64			mperf;
+
+	/* the task that was running when the sample was taken */
+	__u32			pid;
+	__u32			tgid;
+	__u64			nr_switches; /* the task's context switches */
+};
+
 struct ksched_shm_cpu {
 	/* written by userspace */
 	unsigned int		gen;
@@ -41,22 +66,109 @@ struct ksched_shm_cpu {
 	unsigned int		sig;
 	unsigned int		signum;
 	unsigned int		pmc;
-	__u64			pmcsel;
+	unsigned int		pmcnr;
+	__u64			pmcsel[KSCHED_NR_PMC];
 
 	/* written by kernelspace */
-	unsigned int		busy;
 	unsigned int		last_gen;
-	__u64			pmcval;
-	__u64			pmctsc;
+	struct ksched_pmc_sample pmcres;
+	__u64			sample_cycles; /* total TSC cycles spent sampling */
+
+	struct uintr_upid 	upid;
+
+	/*
+	 * written on every context switch (with idleskip=1 or tasks=1), so
+	 * kept off the lines above
+	 */
+	unsigned int		busy __aligned(64); /* not running idle */
+	__u64			wakeups;	/* the times the CPU left idle */
+};
+
+/* the number of samples in each per-CPU ring (must be a power of two) */
+#define KSCHED_RING_SIZE	64
+/* the mmap() offset of the per-CPU sample rings */
+#define KSCHED_RING_OFFSET	0x10000000UL
+/* the shortest supported sampling timer period */
+#define KSCHED_TIMER_MIN_NS	10000
+
+/* samples appended by the per-CPU sampling timer */
+struct ksched_ring {
+	/* written by kernelspace */
+	__u64			head;
 
 	/* extra space for future features (and cache alignment) */
-	unsigned long		rsv[1];
+	unsigned long		rsv[7];
 
-	struct uintr_upid 	upid;
+	struct ksched_pmc_sample samples[KSCHED_RING_SIZE];
+} __aligned(64);
+
+/* the mmap() offset of the per-process counter table */
+#define KSCHED_TASK_OFFSET	0x20000000UL
+/* the number of slots in the per-process table (must be a power of two) */
+#define KSCHED_TASK_TBL_SIZE	16384
+/* the tgid of a slot while it is handed to a new process */
+#define KSCHED_TASK_CLAIMING	(~0U)
+/* how long an exited process's slot is kept before it may be reused */
+#define KSCHED_TASK_REUSE_NS	(10ULL * 1000 * 1000 * 1000)
+
+/*
+ * counter totals of one process, accumulated at each context switch
+ *
+ * A slot is freed when the last thread of its process exits, and reused
+ * KSCHED_TASK_REUSE_NS later, so readers must poll more often than that.
+ * Each reuse adds two to @gen, which is odd while the totals are cleared.
+ */
+struct ksched_task_stat {
+	/* written by kernelspace */
+	__u32			tgid;	/* zero while the slot is unused */
+	__u32			gen;	/* bumped whenever the slot is reused */
+	__u64			exit_ns; /* when the process exited, or zero */
+	__u64			switches;
+	__u64			val[KSCHED_NR_PMC];
+	__u64			fixed[KSCHED_NR_FIXED];
+} __aligned(64);
+
+/* per-process counters, only filled when loaded with tasks=1 */
+struct ksched_task_tbl {
+	/* written by kernelspace */
+	__u64			dropped; /* switches lost to a full table */
+
+	/* extra space for future features (and cache alignment) */
+	unsigned long		rsv[7];
+
+	struct ksched_task_stat	tasks[KSCHED_TASK_TBL_SIZE];
+} __aligned(64);
+
+struct ksched_timer_req {
+	__u64			period_ns; /* zero disarms the timers */
+	size_t			len;
+	const void __user	*mask;
+};
+
+/* one core's result from KSCHED_IOC_SAMPLE */
+struct ksched_sample_res {
+	__u32			cpu;
+	__u32			pad;
+	struct ksched_pmc_sample pmc;
+};
+
+struct ksched_sample_req {
+	size_t			len;
+	const void __user	*mask;
+	__u32			nr; /* the capacity of @res */
+	__u32			pad;
+	struct ksched_sample_res __user *res;
+};
+
+/* the counter group to reserve when ksched uses perf_event counters */
+struct ksched_pmc_setup_req {
+	__u32			nr;
+	__u32			pad;
+	__u64			sel[KSCHED_NR_PMC];
 };
 
 #define KSCHED_MAGIC		0xF0
-#define KSCHED_IOC_MAXNR	6
+#define KSCHED_IOC_MAXNR	9
 
 #define KSCHED_IOC_START	_IO(KSCHED_MAGIC, 1)
 #define KSCHED_IOC_PARK		_IO(KSCHED_MAGIC, 2)
@@ -64,4 +176,7 @@ struct ksched_shm_cpu {
 #define KSCHED_IOC_UINTR_MULTICAST _IOW(KSCHED_MAGIC, 4, struct ksched_intr_req)
 #define KSCHED_IOC_UINTR_SETUP_USER		_IO(KSCHED_MAGIC, 5)
 #define KSCHED_IOC_UINTR_SETUP_ADMIN		_IO(KSCHED_MAGIC, 6)
+#define KSCHED_IOC_TIMER	_IOW(KSCHED_MAGIC, 7, struct ksched_timer_req)
+#define KSCHED_IOC_SAMPLE	_IOWR(KSCHED_MAGIC, 8, struct ksched_sample_req)
+#define KSCHED_IOC_PMC_SETUP	_IOW(KSCHED_MAGIC, 9, struct ksched_pmc_setup_req)
 
@@ -7,6 +7,8 @@
 #include <asm/msr-index.h>
 #include <asm/msr.h>
 #include <asm/mwait.h>
+#include <asm/perf_event.h>
+#include <asm/processor.h>
 #include <asm/tlbflush.h>
 #include <linux/capability.h>
 #include <linux/cdev.h>
@@ -18,10 +20,14 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
 #include <linux/sched/task.h>
 #include <linux/smp.h>
+#include <linux/hash.h>
+#include <linux/tracepoint.h>
 #include <linux/uaccess.h>
 #include <linux/signal.h>
 #include <linux/version.h>
@@ -32,8 +38,7 @@
 #include "defs.h"
 // #include "../iokernel/pmc.h"
 
-#define CORE_PERF_GLOBAL_CTRL_ENABLE_PMC_0 (0x1)
-#define CORE_PERF_GLOBAL_CTRL_ENABLE_PMC_1 (0x2)
+#define CORE_PERF_GLOBAL_CTRL_ENABLE_PMC(nr) ((1UL << (nr)) - 1)
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6,1,0)
 #define PF__HOLE__40000000 0x40000000
@@ -48,25 +53,158 @@ static struct cdev ksched_cdev;
 __read_mostly struct ksched_shm_cpu *shm;
 #define SHM_SIZE (NR_CPUS * sizeof(struct ksched_shm_cpu))
 
+/* per-CPU sample rings filled by the sampling timer (also shared) */
+__read_mostly struct ksched_ring *rings;
+#define RINGS_SIZE (nr_cpu_ids * sizeof(struct ksched_ring))
+
+/* per-process counter totals kept at context switches (also shared) */
+__read_mostly struct ksched_task_tbl *tasks;
+#define TASKS_SIZE (sizeof(struct ksched_task_tbl))
+/* how many slots a lookup probes before giving up */
+#define TASKS_MAX_PROBE 32
+
 /* per-cpu data to coordinate context switching and signal delivery */
 DEFINE_PER_CPU(struct ksched_percpu, kp);
 
+/* a preallocated mask for synchronous sampling (protected by sample_lock) */
+static cpumask_var_t sample_mask;
+static DEFINE_MUTEX(sample_lock);
+
+/* the number of general-purpose counters usable by ksched */
+static unsigned int ksched_nr_pmc;
+/* the width of raw general-purpose and fixed counter deltas */
+static u64 ksched_pmc_mask = ~0ULL, ksched_fixed_mask = ~0ULL;
+
+/* reserve counters through perf_event instead of programming raw MSRs */
+static bool ksched_use_perf;
+module_param_named(perf, ksched_use_perf, bool, 0444);
+MODULE_PARM_DESC(perf, "share the PMU with perf via in-kernel perf_event counters");
+
+/* account counters to processes at every context switch */
+static bool ksched_use_tasks;
+module_param_named(tasks, ksched_use_tasks, bool, 0444);
+MODULE_PARM_DESC(tasks, "accumulate per-process counters at every context switch");
+
+static struct tracepoint *sched_switch_tp;
+static struct tracepoint *sched_exit_tp;
+/* whether the sched_switch probe is registered */
+static bool ksched_switch_on;
+
+/* track idle CPUs so counterd can skip them */
+static bool ksched_use_idleskip;
+module_param_named(idleskip, ksched_use_idleskip, bool, 0444);
+MODULE_PARM_DESC(idleskip, "track each CPU's idle state at every context switch");
+
+/* serializes changes to the perf_event counter group */
+static DEFINE_MUTEX(perf_lock);
+
+static const u64 ksched_perf_fixed_cfg[KSCHED_NR_FIXED] = {
+	[KSCHED_FIXED_INSTR_RETIRED]	= PERF_COUNT_HW_INSTRUCTIONS,
+	[KSCHED_FIXED_CORE_CYCLES]	= PERF_COUNT_HW_CPU_CYCLES,
+	[KSCHED_FIXED_REF_CYCLES]	= PERF_COUNT_HW_REF_CPU_CYCLES,
+};
+
+/*
+ * Reads a kernel counter on the local CPU. If the counter was multiplexed
+ * with other users of the PMU, only the count since the last read is scaled
+ * by how long it ran since then, and added to a running total. Scaling the
+ * whole count by its lifetime ratio instead would let the value go down
+ * whenever that ratio changes.
+ */
+static u64 ksched_perf_read(struct perf_event *event,
+			    struct ksched_perf_ctr *c)
+{
+	u64 val, enabled, running, delta, d_enabled, d_running;
+
+	if (perf_event_read_local(event, &val, &enabled, &running))
+		return c->total;
+
+	delta = val - c->val;
+	d_enabled = enabled - c->enabled;
+	d_running = running - c->running;
+	if (d_running && d_running < d_enabled)
+		delta = mul_u64_u64_div_u64(delta, d_enabled, d_running);
+
+	c->val = val;
+	c->enabled = enabled;
+	c->running = running;
+	c->total += delta;
+	return c->total;
+}
+
+static void ksched_measure_perf(struct ksched_percpu *p,
+				struct ksched_pmc_sample *out)
+{
+	unsigned int i;
+
+	if (!smp_load_acquire(&p->perf_on))
+		return;
+	for (i = 0; i < p->perf_nr; i++)
+		out->val[i] = ksched_perf_read(p->perf_pmc[i],
+					       &p->perf_pmc_ctr[i]);
+	for (i = 0; i < KSCHED_NR_FIXED; i++)
+		out->fixed[i] = ksched_perf_read(p->perf_fixed[i],
+						 &p->perf_fixed_ctr[i]);
+}
+
 /**
- * ksched_measure_pmc - read a performance counter
- * @sel: selects an x86 performance counter
+ * ksched_measure_pmc - read a group of performance counters
+ * @s: the shared memory for this core (holds the selectors)
+ * @out: the sample to fill in
+ *
+ * All of the selectors are programmed before any counter is read so that
+ * the values in the group cover the same window. The fixed counters enabled
+ * by ksched_init_pmc() and APERF/MPERF are snapshotted alongside them, as
+ * is the identity of the running task.
+ *
+ * When the perf parameter is set, the counters reserved by
+ * ksched_pmc_setup() are read instead and the selectors are ignored.
+ *
+ * The cycles spent here are added to the core's sample_cycles.
  */
-static u64 ksched_measure_pmc(u64 sel)
+static void ksched_measure_pmc(struct ksched_shm_cpu *s,
+			       struct ksched_pmc_sample *out)
 {
 	struct ksched_percpu *p = this_cpu_ptr(&kp);
-	u64 val;
+	unsigned int i, nr;
+	u64 sel, start = rdtsc();
 
-	if (p->last_sel != sel) {
-		wrmsrl(MSR_P6_EVNTSEL0, sel);
-		p->last_sel = sel;
+	if (ksched_use_perf) {
+		ksched_measure_perf(p, out);
+		goto out;
 	}
-	rdmsrl(MSR_P6_PERFCTR0, val);
 
-	return val;
+	nr = min(READ_ONCE(s->pmcnr), ksched_nr_pmc);
+	for (i = 0; i < nr; i++) {
+		sel = READ_ONCE(s->pmcsel[i]);
+		if (p->last_sel[i] != sel) {
+			wrmsrl(MSR_P6_EVNTSEL0 + i, sel);
+			p->last_sel[i] = sel;
+			p->pmc_gen++;
+		}
+	}
+	for (i = 0; i < nr; i++)
+		rdmsrl(MSR_P6_PERFCTR0 + i, out->val[i]);
+	for (i = 0; i < KSCHED_NR_FIXED; i++)
+		rdmsrl(MSR_CORE_PERF_FIXED_CTR0 + i, out->fixed[i]);
+
+out:
+	/* APERF and MPERF are free-running and never reprogrammed */
+	rdmsrl(MSR_IA32_APERF, out->aperf);
+	rdmsrl(MSR_IA32_MPERF, out->mperf);
+	out->tsc = rdtsc();
+
+	/*
+	 * We run in interrupt context, so current is the task that was
+	 * interrupted. If two samples see the same task with the same switch
+	 * count, it ran for the whole window in between.
+	 */
+	out->pid = current->pid;
+	out->tgid = current->tgid;
+	out->nr_switches = current->nvcsw + current->nivcsw;
+
+	/* lets userspace keep the cost of sampling within a budget */
+	WRITE_ONCE(s->sample_cycles, s->sample_cycles + rdtsc() - start);
 }
 
 static void ksched_ipi(void *unused)
@@ -89,14 +227,299 @@ static void ksched_ipi(void *unused)
 	/* check if a performance counter has been requested */
 	tmp = smp_load_acquire(&s->pmc);
 	if (tmp != 0) {
-		s->pmcval = ksched_measure_pmc(READ_ONCE(s->pmcsel));
-		s->pmctsc = rdtsc();
+		ksched_measure_pmc(s, &s->pmcres);
 		smp_store_release(&s->pmc, 0);
 	}
 
 	put_cpu();
 }
 
+/**
+ * ksched_timer_fn - samples the counters on each sampling timer tick
+ * @t: the per-CPU timer that fired
+ *
+ * Appends a sample to this CPU's ring without any involvement from
+ * userspace; the selectors last written to the shm are used.
+ */
+static enum hrtimer_restart ksched_timer_fn(struct hrtimer *t)
+{
+	struct ksched_percpu *p = this_cpu_ptr(&kp);
+	struct ksched_ring *r;
+	int cpu;
+	u64 head;
+
+	cpu = smp_processor_id();
+	r = &rings[cpu];
+	head = r->head;
+	ksched_measure_pmc(&shm[cpu],
+			   &r->samples[head & (KSCHED_RING_SIZE - 1)]);
+	smp_store_release(&r->head, head + 1);
+
+	hrtimer_forward_now(t, p->period);
+	return HRTIMER_RESTART;
+}
+
+static void ksched_timer_start(void *unused)
+{
+	struct ksched_percpu *p = this_cpu_ptr(&kp);
+
+	/* pinned timers are queued on the CPU that starts them */
+	hrtimer_start(&p->timer, p->period, HRTIMER_MODE_REL_PINNED);
+}
+
+static void ksched_timer_stop_all(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		hrtimer_cancel(&per_cpu(kp, cpu).timer);
+}
+
+/* takes an unused slot, or one whose process exited long enough ago */
+static bool ksched_task_claim(struct ksched_task_stat *t, u32 tgid)
+{
+	u32 cur = READ_ONCE(t->tgid);
+	u64 exit_ns;
+
+	if (cur == KSCHED_TASK_CLAIMING)
+		return false;
+	if (cur) {
+		exit_ns = READ_ONCE(t->exit_ns);
+		if (!exit_ns || ktime_get_ns() - exit_ns < KSCHED_TASK_REUSE_NS)
+			return false;
+	}
+	if (cmpxchg(&t->tgid, cur, KSCHED_TASK_CLAIMING) != cur)
+		return false;
+
+	/* an odd generation tells counterd the totals are being cleared */
+	WRITE_ONCE(t->gen, t->gen + 1);
+	smp_wmb();
+	t->exit_ns = 0;
+	t->switches = 0;
+	memset(t->val, 0, sizeof(t->val));
+	memset(t->fixed, 0, sizeof(t->fixed));
+	smp_wmb();
+	WRITE_ONCE(t->gen, t->gen + 1);
+	smp_store_release(&t->tgid, tgid);
+	return true;
+}
+
+/*
+ * Finds the slot of a process, or claims one for it. A tgid may be recycled
+ * while the slot of its exited owner is kept, so only the owner's own exit
+ * may still add to an exited slot.
+ */
+static struct ksched_task_stat *ksched_task_lookup(u32 tgid, bool exiting)
+{
+	struct ksched_task_stat *t;
+	u32 idx, i;
+
+	idx = hash_32(tgid, ilog2(KSCHED_TASK_TBL_SIZE));
+	for (i = 0; i < TASKS_MAX_PROBE; i++) {
+		t = &tasks->tasks[(idx + i) & (KSCHED_TASK_TBL_SIZE - 1)];
+		if (READ_ONCE(t->tgid) == tgid &&
+		    (exiting || !READ_ONCE(t->exit_ns)))
+			return t;
+	}
+
+	for (i = 0; i < TASKS_MAX_PROBE; i++) {
+		t = &tasks->tasks[(idx + i) & (KSCHED_TASK_TBL_SIZE - 1)];
+		if (ksched_task_claim(t, tgid))
+			return t;
+	}
+
+	return NULL;
+}
+
+/* the mask for a counter @width bits wide (0 if CPUID doesn't say) */
+static u64 ksched_width_mask(unsigned int width)
+{
+	return width && width < 64 ? GENMASK_ULL(width - 1, 0) : ~0ULL;
+}
+
+/* adds a task's counter deltas to its process (other CPUs may too) */
+static void ksched_task_credit(struct task_struct *prev,
+			       struct ksched_pmc_sample *start,
+			       struct ksched_pmc_sample *end)
+{
+	struct ksched_task_stat *t;
+	unsigned int i;
+
+	t = ksched_task_lookup(prev->tgid, prev->flags & PF_EXITING);
+	if (unlikely(!t)) {
+		atomic64_inc((atomic64_t *)&tasks->dropped);
+		return;
+	}
+
+	atomic64_inc((atomic64_t *)&t->switches);
+	/* a raw counter may wrap while the task runs */
+	for (i = 0; i < KSCHED_NR_PMC; i++)
+		atomic64_add((end->val[i] - start->val[i]) & ksched_pmc_mask,
+			     (atomic64_t *)&t->val[i]);
+	for (i = 0; i < KSCHED_NR_FIXED; i++)
+		atomic64_add((end->fixed[i] - start->fixed[i]) &
+			     ksched_fixed_mask, (atomic64_t *)&t->fixed[i]);
+}
+
+/**
+ * ksched_switch_probe - tracks idle and credits the task being switched out
+ *
+ * Runs on the sched_switch tracepoint with interrupts disabled, when the
+ * idleskip or tasks parameter is set. The CPU's busy flag follows the idle
+ * task, and every switch out of idle bumps its wakeup count, so counterd
+ * can tell a CPU that stayed idle all window.
+ *
+ * With the tasks parameter, the counters are also credited to the task
+ * switched out. Time spent idle is not credited to anyone. A switch after
+ * the counters were reprogrammed only starts a new baseline.
+ */
+static void ksched_switch_probe(void *data, bool preempt,
+				struct task_struct *prev,
+				struct task_struct *next
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
+				, unsigned int prev_state
+#endif
+				)
+{
+	struct ksched_percpu *p = this_cpu_ptr(&kp);
+	struct ksched_shm_cpu *s = &shm[smp_processor_id()];
+	struct ksched_pmc_sample now;
+	bool busy = !is_idle_task(next);
+
+	if (busy && !READ_ONCE(s->busy))
+		WRITE_ONCE(s->wakeups, s->wakeups + 1);
+	smp_store_release(&s->busy, busy);
+
+	if (!tasks)
+		return;
+
+	/* nothing to read until counterd reserves the counters */
+	if (ksched_use_perf && !READ_ONCE(p->perf_on)) {
+		p->switch_valid = false;
+		return;
+	}
+
+	memset(&now, 0, sizeof(now));
+	ksched_measure_pmc(s, &now);
+	if (p->switch_valid && p->switch_gen == p->pmc_gen && prev->tgid)
+		ksched_task_credit(prev, &p->switch_last, &now);
+
+	p->switch_last = now;
+	p->switch_gen = p->pmc_gen;
+	p->switch_valid = true;
+}
+
+/**
+ * ksched_exit_probe - frees a process's slot when its last thread exits
+ *
+ * Runs on the sched_process_exit tracepoint. The slot keeps its totals for
+ * KSCHED_TASK_REUSE_NS, so counterd can read the final ones, and still
+ * takes the counts of the exiting thread's last switch.
+ */
+static void ksched_exit_probe(void *data, struct task_struct *p
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,14,0)
+			      , bool group_dead
+#endif
+			      )
+{
+	struct ksched_task_stat *t;
+	u32 idx, i;
+
+	/* do_exit() already dropped this thread from the live count */
+	if (atomic_read(&p->signal->live))
+		return;
+
+	idx = hash_32(p->tgid, ilog2(KSCHED_TASK_TBL_SIZE));
+	for (i = 0; i < TASKS_MAX_PROBE; i++) {
+		t = &tasks->tasks[(idx + i) & (KSCHED_TASK_TBL_SIZE - 1)];
+		if (READ_ONCE(t->tgid) == p->tgid && !READ_ONCE(t->exit_ns))
+			WRITE_ONCE(t->exit_ns, ktime_get_ns() ?: 1);
+	}
+}
+
+static void ksched_find_switch_tp(struct tracepoint *tp, void *priv)
+{
+	if (!strcmp(tp->name, "sched_switch"))
+		sched_switch_tp = tp;
+	else if (!strcmp(tp->name, "sched_process_exit"))
+		sched_exit_tp = tp;
+}
+
+/*
+ * The probe only sees switches, so start from what runs right now. Without
+ * the probe, every CPU stays busy, so counterd never skips one as idle.
+ */
+static void ksched_init_busy(void *unused)
+{
+	smp_store_release(&shm[smp_processor_id()].busy,
+			  !ksched_switch_on || !is_idle_task(current));
+}
+
+static int __init ksched_init_switch(void)
+{
+	int ret;
+
+	if (ksched_use_tasks) {
+		tasks = vmalloc_user(TASKS_SIZE);
+		if (!tasks)
+			return -ENOMEM;
+		memset(tasks, 0, TASKS_SIZE);
+	}
+
+	/* the probe runs on every switch, so only add it when asked to */
+	if (!ksched_use_idleskip && !tasks)
+		goto out;
+
+	/* the tracepoint isn't exported to modules, so look it up */
+	for_each_kernel_tracepoint(ksched_find_switch_tp, NULL);
+	ret = -ENOENT;
+	if (sched_switch_tp)
+		ret = tracepoint_probe_register(sched_switch_tp,
+						ksched_switch_probe, NULL);
+	/* only per-process counters can't do without it */
+	if (ret && tasks)
+		goto fail;
+	if (ret)
+		printk(KERN_WARNING "ksched: could not probe context switches, "
+		       "idle cores will not be skipped");
+	ksched_switch_on = !ret;
+
+	/* without it, the slots of exited processes would never be freed */
+	if (tasks) {
+		ret = -ENOENT;
+		if (sched_exit_tp)
+			ret = tracepoint_probe_register(sched_exit_tp,
+							ksched_exit_probe, NULL);
+		if (ret)
+			goto fail_exit;
+	}
+
+out:
+	on_each_cpu(ksched_init_busy, NULL, 1);
+	return 0;
+
+fail_exit:
+	tracepoint_probe_unregister(sched_switch_tp, ksched_switch_probe, NULL);
+	tracepoint_synchronize_unregister();
+fail:
+	vfree(tasks);
+	tasks = NULL;
+	return ret;
+}
+
+static void ksched_exit_switch(void)
+{
+	if (tasks)
+		tracepoint_probe_unregister(sched_exit_tp, ksched_exit_probe,
+					    NULL);
+	if (ksched_switch_on)
+		tracepoint_probe_unregister(sched_switch_tp,
+					    ksched_switch_probe, NULL);
+	tracepoint_synchronize_unregister();
+	vfree(tasks);
+	tasks = NULL;
+}
+
 static int get_user_cpu_mask(const unsigned long __user *user_mask_ptr,
 			     unsigned len, struct cpumask *new_mask)
 {
@@ -133,6 +556,232 @@ static long ksched_intr(struct ksched_intr_req __user *ureq)
 	return 0;
 }
 
+static long ksched_timer(struct ksched_timer_req __user *ureq)
+{
+	cpumask_var_t mask;
+	struct ksched_timer_req req;
+	int cpu;
+
+	/* only the IOKernel can configure sampling (privileged) */
+	if (unlikely(!capable(CAP_SYS_ADMIN)))
+		return -EACCES;
+
+	/* validate inputs */
+	if (unlikely(copy_from_user(&req, ureq, sizeof(req))))
+		return -EFAULT;
+	if (unlikely(req.period_ns && req.period_ns < KSCHED_TIMER_MIN_NS))
+		return -EINVAL;
+	if (unlikely(!alloc_cpumask_var(&mask, GFP_KERNEL)))
+		return -ENOMEM;
+	if (unlikely(get_user_cpu_mask((const unsigned long __user *)req.mask,
+				       req.len, mask))) {
+		free_cpumask_var(mask);
+		return -EFAULT;
+	}
+	cpumask_and(mask, mask, cpu_online_mask);
+
+	/* stop any running timers first, then rearm with the new period */
+	for_each_cpu(cpu, mask) {
+		hrtimer_cancel(&per_cpu(kp, cpu).timer);
+		per_cpu(kp, cpu).period = ns_to_ktime(req.period_ns);
+	}
+	if (req.period_ns)
+		on_each_cpu_mask(mask, ksched_timer_start, NULL, true);
+
+	free_cpumask_var(mask);
+	return 0;
+}
+
+static void ksched_sample_ipi(void *unused)
+{
+	struct ksched_percpu *p = this_cpu_ptr(&kp);
+
+	ksched_measure_pmc(&shm[smp_processor_id()], &p->sample);
+}
+
+/**
+ * ksched_sample - samples a set of cores and waits for the results
+ * @ureq: the cores to sample and where to store the results
+ *
+ * The counters are read on every core by the same synchronous IPI broadcast,
+ * using the selectors last written to the shm. Returns the number of
+ * results copied out, or a negative error code.
+ */
+static long ksched_sample(struct ksched_sample_req __user *ureq)
+{
+	struct ksched_sample_req req;
+	struct ksched_sample_res res;
+	long ret = 0;
+	int cpu;
+
+	/* only the IOKernel can sample counters (privileged) */
+	if (unlikely(!capable(CAP_SYS_ADMIN)))
+		return -EACCES;
+
+	/* validate inputs */
+	if (unlikely(copy_from_user(&req, ureq, sizeof(req))))
+		return -EFAULT;
+
+	mutex_lock(&sample_lock);
+	if (unlikely(get_user_cpu_mask((const unsigned long __user *)req.mask,
+				       req.len, sample_mask))) {
+		ret = -EFAULT;
+		goto out;
+	}
+	cpumask_and(sample_mask, sample_mask, cpu_online_mask);
+
+	on_each_cpu_mask(sample_mask, ksched_sample_ipi, NULL, true);
+
+	memset(&res, 0, sizeof(res));
+	for_each_cpu(cpu, sample_mask) {
+		if (ret == req.nr)
+			break;
+		res.cpu = cpu;
+		res.pmc = per_cpu(kp, cpu).sample;
+		if (unlikely(copy_to_user(&req.res[ret], &res, sizeof(res)))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		ret++;
+	}
+
+out:
+	mutex_unlock(&sample_lock);
+	return ret;
+}
+
+static void ksched_perf_detach(void *unused)
+{
+	struct ksched_percpu *p = this_cpu_ptr(&kp);
+
+	WRITE_ONCE(p->perf_on, false);
+	p->pmc_gen++;
+}
+
+static void ksched_perf_release(int cpu)
+{
+	struct ksched_percpu *p = per_cpu_ptr(&kp, cpu);
+	unsigned int i;
+
+	/* make sure no interrupt on @cpu is still reading the counters */
+	smp_call_function_single(cpu, ksched_perf_detach, NULL, 1);
+
+	for (i = 0; i < KSCHED_NR_PMC; i++) {
+		if (p->perf_pmc[i])
+			perf_event_release_kernel(p->perf_pmc[i]);
+		p->perf_pmc[i] = NULL;
+	}
+	for (i = 0; i < KSCHED_NR_FIXED; i++) {
+		if (p->perf_fixed[i])
+			perf_event_release_kernel(p->perf_fixed[i]);
+		p->perf_fixed[i] = NULL;
+	}
+	p->perf_nr = 0;
+}
+
+static void ksched_perf_release_all(void)
+{
+	int cpu;
+
+	mutex_lock(&perf_lock);
+	for_each_online_cpu(cpu)
+		ksched_perf_release(cpu);
+	mutex_unlock(&perf_lock);
+}
+
+static struct perf_event *ksched_perf_create(int cpu, u32 type, u64 config,
+					     u64 sel)
+{
+	struct perf_event_attr attr = {
+		.type		= type,
+		.size		= sizeof(attr),
+		.config		= config,
+		.exclude_user	= !(sel & ARCH_PERFMON_EVENTSEL_USR),
+		.exclude_kernel	= !(sel & ARCH_PERFMON_EVENTSEL_OS),
+	};
+
+	return perf_event_create_kernel_counter(&attr, cpu, NULL, NULL, NULL);
+}
+
+static int ksched_perf_attach(int cpu, struct ksched_pmc_setup_req *req)
+{
+	struct ksched_percpu *p = per_cpu_ptr(&kp, cpu);
+	struct perf_event *event;
+	unsigned int i;
+	u64 config;
+
+	for (i = 0; i < req->nr; i++) {
+		/* perf takes the event encoding, not the enable/mode bits */
+		config = req->sel[i] & ~(ARCH_PERFMON_EVENTSEL_USR |
+					 ARCH_PERFMON_EVENTSEL_OS |
+					 ARCH_PERFMON_EVENTSEL_INT |
+					 ARCH_PERFMON_EVENTSEL_PIN_CONTROL |
+					 ARCH_PERFMON_EVENTSEL_ENABLE);
+		event = ksched_perf_create(cpu, PERF_TYPE_RAW, config,
+					   req->sel[i]);
+		if (IS_ERR(event))
+			return PTR_ERR(event);
+		p->perf_pmc[i] = event;
+	}
+	for (i = 0; i < KSCHED_NR_FIXED; i++) {
+		event = ksched_perf_create(cpu, PERF_TYPE_HARDWARE,
+					   ksched_perf_fixed_cfg[i],
+					   ARCH_PERFMON_EVENTSEL_USR |
+					   ARCH_PERFMON_EVENTSEL_OS);
+		if (IS_ERR(event))
+			return PTR_ERR(event);
+		p->perf_fixed[i] = event;
+	}
+
+	/* new counters start from zero */
+	memset(p->perf_pmc_ctr, 0, sizeof(p->perf_pmc_ctr));
+	memset(p->perf_fixed_ctr, 0, sizeof(p->perf_fixed_ctr));
+	p->perf_nr = req->nr;
+	smp_store_release(&p->perf_on, true);
+	return 0;
+}
+
+/**
+ * ksched_pmc_setup - reserves the counter group through perf_event
+ * @ureq: the selectors to reserve
+ *
+ * Only has an effect when the perf parameter is set; otherwise the
+ * selectors are programmed directly from the shm on each request.
+ */
+static long ksched_pmc_setup(struct ksched_pmc_setup_req __user *ureq)
+{
+	struct ksched_pmc_setup_req req;
+	long ret = 0;
+	int cpu;
+
+	/* only the IOKernel can reserve counters (privileged) */
+	if (unlikely(!capable(CAP_SYS_ADMIN)))
+		return -EACCES;
+
+	/* validate inputs */
+	if (unlikely(copy_from_user(&req, ureq, sizeof(req))))
+		return -EFAULT;
+	if (unlikely(req.nr > KSCHED_NR_PMC))
+		return -EINVAL;
+	if (!ksched_use_perf)
+		return 0;
+
+	mutex_lock(&perf_lock);
+	for_each_online_cpu(cpu) {
+		ksched_perf_release(cpu);
+		ret = ksched_perf_attach(cpu, &req);
+		if (ret) {
+			ksched_perf_release(cpu);
+			break;
+		}
+	}
+	mutex_unlock(&perf_lock);
+
+	if (ret)
+		ksched_perf_release_all();
+	return ret;
+}
+
 static long
 ksched_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
@@ -149,6 +798,12 @@ ksched_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	// 	return ksched_park(to_uintr_ctx(filp), arg);
 	case KSCHED_IOC_INTR:
 		return ksched_intr((void __user *)arg);
+	case KSCHED_IOC_TIMER:
+		return ksched_timer((void __user *)arg);
+	case KSCHED_IOC_SAMPLE:
+		return ksched_sample((void __user *)arg);
+	case KSCHED_IOC_PMC_SETUP:
+		return ksched_pmc_setup((void __user *)arg);
 	// case KSCHED_IOC_UINTR_MULTICAST:
 	// 	return uintr_multicast((void __user *)arg);
 	// case KSCHED_IOC_UINTR_SETUP_USER:
@@ -167,6 +822,15 @@ static int ksched_mmap(struct file *file, struct vm_area_struct *vma)
 	/* only the IOKernel can access the shared region (privileged) */
 	if (!capable(CAP_SYS_ADMIN))
 		return -EACCES;
+	if (vma->vm_pgoff >= (KSCHED_TASK_OFFSET >> PAGE_SHIFT)) {
+		if (!tasks)
+			return -ENODEV;
+		return remap_vmalloc_range(vma, (void *)tasks, vma->vm_pgoff -
+					   (KSCHED_TASK_OFFSET >> PAGE_SHIFT));
+	}
+	if (vma->vm_pgoff >= (KSCHED_RING_OFFSET >> PAGE_SHIFT))
+		return remap_vmalloc_range(vma, (void *)rings, vma->vm_pgoff -
+					   (KSCHED_RING_OFFSET >> PAGE_SHIFT));
 	return remap_vmalloc_range(vma, (void *)shm, vma->vm_pgoff);
 }
 
@@ -178,6 +842,8 @@ static int ksched_open(struct inode *inode, struct file *filp)
 static int ksched_release(struct inode *inode, struct file *filp)
 {
 	// uintr_file_release(filp);
+	ksched_timer_stop_all();
+	ksched_perf_release_all();
 	return 0;
 }
 
@@ -193,11 +859,27 @@ static void __init ksched_init_pmc(void *arg)
 {
 	wrmsrl(MSR_CORE_PERF_FIXED_CTR_CTRL, 0x333);
 	wrmsrl(MSR_CORE_PERF_GLOBAL_CTRL,
-	       CORE_PERF_GLOBAL_CTRL_ENABLE_PMC_0 |
-	       CORE_PERF_GLOBAL_CTRL_ENABLE_PMC_1 |
+	       CORE_PERF_GLOBAL_CTRL_ENABLE_PMC(ksched_nr_pmc) |
 	       (1UL << 32) | (1UL << 33) | (1UL << 34));
 }
 
+static void __init ksched_init_timers(void)
+{
+	struct hrtimer *t;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		t = &per_cpu(kp, cpu).timer;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,13,0)
+		hrtimer_init(t, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+		t->function = ksched_timer_fn;
+#else
+		hrtimer_setup(t, ksched_timer_fn, CLOCK_MONOTONIC,
+			      HRTIMER_MODE_REL_PINNED);
+#endif
+	}
+}
+
 static int __init ksched_init(void)
 {
 	dev_t devno_ksched = MKDEV(KSCHED_MAJOR, KSCHED_MINOR);
@@ -223,6 +905,19 @@ static int __init ksched_init(void)
 	}
 	memset(shm, 0, SHM_SIZE);
 
+	rings = vmalloc_user(RINGS_SIZE);
+	if (!rings) {
+		ret = -ENOMEM;
+		goto fail_rings;
+	}
+	memset(rings, 0, RINGS_SIZE);
+	ksched_init_timers();
+
+	if (!zalloc_cpumask_var(&sample_mask, GFP_KERNEL)) {
+		ret = -ENOMEM;
+		goto fail_mask;
+	}
+
 	// ret = uintr_init();
 	// if (ret)
 	// 	goto fail_uintr;
@@ -231,15 +926,44 @@ static int __init ksched_init(void)
 	// if (ret)
 	// 	goto fail_hijack;
 
-	smp_call_function(ksched_init_pmc, NULL, 1);
-	ksched_init_pmc(NULL);
-	printk(KERN_INFO "ksched: API V2 enabled");
+	/* CPUID.0AH:EAX[15:8] reports the general-purpose counters per thread */
+	ksched_nr_pmc = min_t(unsigned int, (cpuid_eax(0xa) >> 8) & 0xff,
+			      KSCHED_NR_PMC);
+	printk(KERN_INFO "ksched: %u general-purpose counters", ksched_nr_pmc);
+
+	/* perf owns the PMU configuration (and counts in 64 bits) when used */
+	if (!ksched_use_perf) {
+		/* CPUID.0AH:EAX[23:16] and EDX[12:5] report the widths */
+		ksched_pmc_mask = ksched_width_mask((cpuid_eax(0xa) >> 16) &
+						    0xff);
+		ksched_fixed_mask = ksched_width_mask((cpuid_edx(0xa) >> 5) &
+						      0xff);
+		smp_call_function(ksched_init_pmc, NULL, 1);
+		ksched_init_pmc(NULL);
+	}
+
+	ret = ksched_init_switch();
+	if (ret) {
+		printk(KERN_ERR "ksched: could not set up per-process counters");
+		goto fail_switch;
+	}
+
+	printk(KERN_INFO "ksched: API V2 enabled (%s counters%s%s)",
+	       ksched_use_perf ? "perf_event" : "raw MSR",
+	       ksched_use_tasks ? ", per-process" : "",
+	       ksched_switch_on ? ", idle tracking" : "");
 	return 0;
 
 // fail_uintr:
 // 	vfree(shm);
 // fail_hijack:
 // 	uintr_exit();
+fail_switch:
+	free_cpumask_var(sample_mask);
+fail_mask:
+	vfree(rings);
+fail_rings:
+	vfree(shm);
 fail_shm:
 	cdev_del(&ksched_cdev);
 fail_ksched_cdev_add:
@@ -251,6 +975,11 @@ static void __exit ksched_exit(void)
 {
 	dev_t devno_ksched = MKDEV(KSCHED_MAJOR, KSCHED_MINOR);
 
+	ksched_exit_switch();
+	ksched_timer_stop_all();
+	ksched_perf_release_all();
+	free_cpumask_var(sample_mask);
+	vfree(rings);
 	vfree(shm);
 	cdev_del(&ksched_cdev);
 	unregister_chrdev_region(devno_ksched, 1);
@@ -0,0 +1,72 @@
+/*
+ * balance.c - an example policy that spreads memory bandwidth across sockets
+ *
+ * When one socket's DRAM bandwidth is more than a threshold (MB/s, the
+ * policy's argument, 10000 by default) above another's, the process with the
+ * highest miss rate on the busier socket is pinned to an idle core of the
+ * other one.
+ *
+ * Build with 'make policies' and run with
+ * 'counterd policy policies/balance.so args 10000'.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <counter/policy.h>
+
+/* a core counts as idle below this fraction of unhalted cycles */
+#define BALANCE_IDLE		0.05
+
+static const struct counter_policy_actions *act;
+static float balance_mbps = 10000.0;
+
+static int balance_init(const struct counter_policy_actions *a,
+			const char *args)
+{
+	act = a;
+	if (args)
+		balance_mbps = strtof(args, NULL);
+	return balance_mbps > 0 ? 0 : -EINVAL;
+}
+
+static void balance_window(const struct counter_policy_window *w)
+{
+	unsigned int i, hot = 0, cold = 0;
+	int victim = -1, target = -1;
+
+	if (w->nr_sockets < 2)
+		return;
+
+	for (i = 1; i < w->nr_sockets; i++) {
+		if (w->bw_mbps[i] > w->bw_mbps[hot])
+			hot = i;
+		if (w->bw_mbps[i] < w->bw_mbps[cold])
+			cold = i;
+	}
+	if (w->bw_mbps[hot] - w->bw_mbps[cold] < balance_mbps)
+		return;
+
+	for (i = 0; i < w->nr_cores; i++) {
+		if (w->socket[i] == hot && w->tgid[i] &&
+		    (victim < 0 || w->miss_rate[i] > w->miss_rate[victim]))
+			victim = i;
+		if (w->socket[i] == cold && w->busy[i] < BALANCE_IDLE &&
+		    target < 0)
+			target = i;
+	}
+	if (victim < 0 || target < 0)
+		return;
+
+	if (act->pin(w->tgid[victim], w->core[target]) == 0)
+		printf("balance: moved %u from core %u to %u\n", w->tgid[victim],
+		       w->core[victim], w->core[target]);
+}
+
+const struct counter_policy counter_policy = {
+	.abi	= COUNTER_POLICY_ABI,
+	.name	= "balance",
+	.init	= balance_init,
+	.window	= balance_window,
+};
@@ -0,0 +1,73 @@
+/*
+ * ht_punish.c - an example policy that idles hyperthreads starving their
+ * siblings
+ *
+ * Each core's IPC while its sibling is idle is remembered as its solo IPC.
+ * When a busy core runs at less than a fraction (the policy's argument, 0.7
+ * by default) of its solo IPC and its sibling misses in L2 more than it does,
+ * the sibling is idled for the next window, like the IOKernel's hyperthread
+ * punishment.
+ *
+ * Run with 'counterd policy policies/ht_punish.so args 0.7'.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <counter/policy.h>
+
+/* a core counts as busy above, and idle below, these unhalted fractions */
+#define HT_BUSY			0.5
+#define HT_IDLE			0.1
+/* how long a sibling is idled (counterd stops at the window's end) */
+#define HT_PUNISH_US		100000
+#define HT_MAX_CORES		1024
+
+static const struct counter_policy_actions *act;
+static float ht_thresh = 0.7;
+static float solo_ipc[HT_MAX_CORES];
+
+static int ht_init(const struct counter_policy_actions *a, const char *args)
+{
+	act = a;
+	if (args)
+		ht_thresh = strtof(args, NULL);
+	return ht_thresh > 0 && ht_thresh < 1 ? 0 : -EINVAL;
+}
+
+static void ht_window(const struct counter_policy_window *w)
+{
+	unsigned int i, core;
+	int sib;
+
+	for (i = 0; i < w->nr_cores; i++) {
+		core = w->core[i];
+		sib = w->sibling[i];
+		if (sib < 0 || core >= HT_MAX_CORES)
+			continue;
+
+		if (w->busy[sib] < HT_IDLE) {
+			solo_ipc[core] = w->ipc[i];
+			continue;
+		}
+		if (w->busy[i] < HT_BUSY || !solo_ipc[core] ||
+		    w->ipc[i] >= solo_ipc[core] * ht_thresh)
+			continue;
+
+		/* LLC references are the L2 misses */
+		if (w->llc_refs[sib] <= w->llc_refs[i])
+			continue;
+		if (act->idle(w->core[sib], HT_PUNISH_US) == 0)
+			printf("ht_punish: idled core %u (core %u at %.2f of "
+			       "its solo IPC)\n", w->core[sib], core,
+			       w->ipc[i] / solo_ipc[core]);
+	}
+}
+
+const struct counter_policy counter_policy = {
+	.abi	= COUNTER_POLICY_ABI,
+	.name	= "ht_punish",
+	.init	= ht_init,
+	.window	= ht_window,
+};
@@ -8,6 +8,15 @@ rm /dev/ksched
 
 if [[ "$1x" = "nouintrx" ]]; then
   insmod $(dirname $0)/../ksched/build/ksched.ko nouintr=1
+elif [[ "$1x" = "perfx" ]]; then
+  # share the PMU with perf/NMI watchdog instead of programming MSRs
+  insmod $(dirname $0)/../ksched/build/ksched.ko perf=1
+elif [[ "$1x" = "tasksx" ]]; then
+  # also keep exact per-process counter totals at every context switch
+  insmod $(dirname $0)/../ksched/build/ksched.ko tasks=1
+elif [[ "$1x" = "idleskipx" ]]; then
+  # track idle CPUs at every context switch, for 'counterd idleskip'
+  insmod $(dirname $0)/../ksched/build/ksched.ko idleskip=1
 else
   insmod $(dirname $0)/../ksched/build/ksched.ko
 fi